@@ -0,0 +1,98 @@
+#include <CommandParser.h>
+
+// Times parse_integer/parse_float against the ctype based integer loop CommandParser used before and strtod/strtof.
+
+// The previous strToInt, kept here as the reference point
+template<typename T>
+size_t legacyStrToInt(const char *buf, T *value, T min_value, T max_value) {
+  size_t position = 0;
+  bool isNegative = false;
+  if (min_value < 0 && (buf[position] == '+' || buf[position] == '-')) {
+    isNegative = (buf[position] == '-');
+    position++;
+  }
+  int base = 10;
+  if (buf[position] == '0') {
+    char prefix = std::tolower(buf[position + 1]);
+    if (prefix == 'b') { base = 2; position += 2; }
+    else if (prefix == 'o') { base = 8; position += 2; }
+    else if (prefix == 'x') { base = 16; position += 2; }
+  }
+  T result = 0;
+  while (true) {
+    char c = buf[position];
+    int digit = -1;
+    if (std::isdigit(c)) digit = c - '0';
+    else if (base == 16 && std::isalpha(c)) digit = std::tolower(c) - 'a' + 10;
+    if (digit < 0 || digit >= base) break;
+    if (result > (max_value - digit) / base) return 0;
+    result = result * base + digit;
+    position++;
+  }
+  if (isNegative) result = -result;
+  if (result < min_value || result > max_value) return 0;
+  *value = result;
+  return position;
+}
+
+const char *integers[] = {"0", "42", "-17", "123456789", "-9876543210", "0x7FFF", "0b101010", "9223372036854775807"};
+const char *reals[] = {"0", "1.5", "-0.25", "3.14159", "-273.15", "6.02e23", "1e-9", "12345.6789"};
+const int ROUNDS = 1000;
+
+volatile int64_t integerSink;
+volatile double doubleSink;
+volatile float floatSink;
+
+template<typename Function>
+void run(const char *name, Function function) {
+  unsigned long start = micros();
+  for (int round = 0; round < ROUNDS; ++round) function();
+  unsigned long elapsed = micros() - start;
+  Serial.print(name);
+  Serial.print(": ");
+  Serial.print(elapsed);
+  Serial.println(" us");
+}
+
+void setup() {
+  Serial.begin(9600);
+  while (!Serial);
+
+  run("legacy strToInt", [] {
+    for (auto text : integers) {
+      int64_t value = 0;
+      legacyStrToInt<int64_t>(text, &value, INT64_MIN, INT64_MAX);
+      integerSink = value;
+    }
+  });
+  run("parse_integer", [] {
+    for (auto text : integers) {
+      int64_t value = 0;
+      parse_integer(text, text + strlen(text), value);
+      integerSink = value;
+    }
+  });
+  run("strtod", [] {
+    for (auto text : reals) doubleSink = strtod(text, nullptr);
+  });
+  run("parse_float<double>", [] {
+    for (auto text : reals) {
+      double value = 0;
+      parse_float(text, text + strlen(text), value);
+      doubleSink = value;
+    }
+  });
+  run("strtof", [] {
+    for (auto text : reals) floatSink = strtof(text, nullptr);
+  });
+  run("parse_float<float>", [] {
+    for (auto text : reals) {
+      float value = 0;
+      parse_float(text, text + strlen(text), value);
+      floatSink = value;
+    }
+  });
+}
+
+void loop() {
+}
@@ -0,0 +1,131 @@
+//
+// Created by fogoz on 14/10/2026.
+//
+
+// Just enough of the Arduino core for the library to build on a desktop: Print, Stream, the clock and PSTR.
+// It is only on the include path of the host target (see CMakeLists.txt), a sketch still gets the board's own.
+
+#ifndef PAMITEENSY_HOST_ARDUINO_H
+#define PAMITEENSY_HOST_ARDUINO_H
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <string_view>
+
+#define PSTR(s) (s)
+
+inline unsigned long micros() {
+    using namespace std::chrono;
+    static const auto start = steady_clock::now();
+    return static_cast<unsigned long>(duration_cast<microseconds>(steady_clock::now() - start).count());
+}
+
+inline unsigned long millis() {
+    return micros() / 1000;
+}
+
+class Print {
+public:
+    virtual ~Print() = default;
+
+    virtual size_t write(uint8_t c) = 0;
+
+    virtual size_t write(const uint8_t *buffer, size_t size) {
+        size_t written = 0;
+        while (size-- != 0) written += write(*buffer++);
+        return written;
+    }
+
+    size_t write(const char *str) {
+        return str == nullptr ? 0 : write(reinterpret_cast<const uint8_t *>(str), strlen(str));
+    }
+
+    size_t write(const char *buffer, size_t size) {
+        return write(reinterpret_cast<const uint8_t *>(buffer), size);
+    }
+
+    virtual int availableForWrite() {
+        return 0;
+    }
+
+    virtual void flush() {}
+
+    size_t print(const char *str) { return write(str); }
+    size_t print(char c) { return write(static_cast<uint8_t>(c)); }
+    size_t print(int value) { return printNumber("%d", value); }
+    size_t print(unsigned int value) { return printNumber("%u", value); }
+    size_t print(long value) { return printNumber("%ld", value); }
+    size_t print(unsigned long value) { return printNumber("%lu", value); }
+    size_t print(long long value) { return printNumber("%lld", value); }
+    size_t print(unsigned long long value) { return printNumber("%llu", value); }
+
+    size_t print(double value, int digits = 2) {
+        char text[64];
+        int length = snprintf(text, sizeof(text), "%.*f", digits, value);
+        return write(text, static_cast<size_t>(length));
+    }
+
+    size_t println() { return write("\r\n"); }
+
+    template<typename T>
+    size_t println(T value) {
+        size_t written = print(value);
+        return written + println();
+    }
+
+private:
+    template<typename T>
+    size_t printNumber(const char *format, T value) {
+        char text[24];
+        int length = snprintf(text, sizeof(text), format, value);
+        return write(text, static_cast<size_t>(length));
+    }
+};
+
+class Stream : public Print {
+public:
+    virtual int available() = 0;
+    virtual int read() = 0;
+    virtual int peek() = 0;
+};
+
+// A link fed from a string, what is written to it is kept unless discard is set
+class MockStream : public Stream {
+public:
+    std::string input;
+    std::string output;
+    size_t position = 0;
+    bool discard = false;
+    int txRoom = 64;
+
+    using Print::write;
+
+    // Appends to the pending input, what was already read stays consumed
+    void feed(std::string_view text) {
+        input.erase(0, position);
+        position = 0;
+        input.append(text.data(), text.size());
+    }
+
+    int available() override { return static_cast<int>(input.size() - position); }
+
+    int read() override { return position < input.size() ? static_cast<uint8_t>(input[position++]) : -1; }
+
+    int peek() override { return position < input.size() ? static_cast<uint8_t>(input[position]) : -1; }
+
+    size_t write(uint8_t c) override {
+        if (!discard) output.push_back(static_cast<char>(c));
+        return 1;
+    }
+
+    size_t write(const uint8_t *buffer, size_t size) override {
+        if (!discard) output.append(reinterpret_cast<const char *>(buffer), size);
+        return size;
+    }
+
+    int availableForWrite() override { return txRoom; }
+};
+#endif //PAMITEENSY_HOST_ARDUINO_H
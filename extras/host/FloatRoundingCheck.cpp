@@ -0,0 +1,86 @@
+//
+// Created by fogoz on 14/10/2026.
+//
+
+// parse_float against the C library: every literal has to give the bits strtof / strtod give, and be read whole.
+// Random literals, short and long, around every exponent the fast paths take, plus cases known to round badly.
+// Exits with 1 on the first mismatches, listing them.
+
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include "FastNumber.h"
+
+static size_t failures = 0;
+
+template<typename T>
+static void check(const std::string &text) {
+    T expected;
+    char *end;
+    if constexpr (std::is_same_v<T, float>) expected = strtof(text.c_str(), &end);
+    else expected = strtod(text.c_str(), &end);
+    T parsed = 0;
+    const char *last = text.data() + text.size();
+    const char *stop = parse_float(text.data(), last, parsed);
+    bool same = stop == end && memcmp(&parsed, &expected, sizeof(T)) == 0;
+    if (same) return;
+    if (failures++ < 20) {
+        printf("%s %s: parsed %.17g, expected %.17g\n", std::is_same_v<T, float> ? "float" : "double", text.c_str(),
+               static_cast<double>(parsed), static_cast<double>(expected));
+    }
+}
+
+static void checkBoth(const std::string &text) {
+    check<float>(text);
+    check<double>(text);
+}
+
+int main() {
+    const char *known[] = {
+            "0", "-0", "0.0", "1", "0.1", "0.2", "0.3", "1.5", "-273.15", "3.14159265358979", "6.02e23", "1e-9",
+            "16777216", "16777217", "16777218", "16777219", "33554431", "33554433", "9007199254740993",
+            "3.4028235e38", "3.4028236e38", "1.17549435e-38", "1.4e-45", "7.038531e-26", "1.00000005960464477539",
+            "1.0000000596046448", "0.000000059604644775390625", "4.5035996e15", "123456789", "4294967295",
+            "1e10", "1e11", "1e22", "1e23", "8.589973e9", "2.3509886e-38", "1.1754943e-38", "0.1e1", ".5", "5.",
+            "12345.6789", "2.7182818284590452353602874713527", "1e0400", "1e-400",
+    };
+    for (auto text : known) checkBoth(text);
+
+    std::mt19937_64 random(20261014);
+    std::string text;
+    char exponent[16];
+    for (int round = 0; round < 400000; ++round) {
+        text.clear();
+        if (random() & 1) text += '-';
+        int digits = 1 + static_cast<int>(random() % (round % 2 == 0 ? 8 : 25));
+        int point = static_cast<int>(random() % (digits + 1));
+        for (int i = 0; i < digits; ++i) {
+            if (i == point && i != 0) text += '.';
+            text += static_cast<char>('0' + random() % 10);
+        }
+        if (random() % 3 != 0) {
+            snprintf(exponent, sizeof(exponent), "e%d", static_cast<int>(random() % 61) - 30);
+            text += exponent;
+        }
+        checkBoth(text);
+    }
+
+    // Every float next to a power of two and its midpoints, written with enough digits to name them
+    for (int power = -40; power <= 40; ++power) {
+        float base = std::ldexp(1.0f, power);
+        for (float value : {std::nextafter(base, 0.0f), base, std::nextafter(base, 1e38f)}) {
+            double next = std::nextafter(value, 1e38f);
+            char literal[64];
+            snprintf(literal, sizeof(literal), "%.9g", static_cast<double>(value));
+            checkBoth(literal);
+            snprintf(literal, sizeof(literal), "%.17g", (static_cast<double>(value) + next) / 2);
+            checkBoth(literal);
+        }
+    }
+
+    printf("%zu mismatches\n", failures);
+    return failures == 0 ? 0 : 1;
+}
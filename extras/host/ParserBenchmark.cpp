@@ -0,0 +1,214 @@
+//
+// Created by fogoz on 14/10/2026.
+//
+
+// Host side numbers for the parser: dispatch latency by command count and argument mix, completion cost, number
+// parsing against the C library, pasted input through CommandLineHandler and heap allocations per command.
+// Times are per operation, averaged over a fixed number of rounds on the steady clock.
+
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include "CommandParser.h"
+
+static size_t allocations = 0;
+
+void *operator new(size_t size) {
+    allocations++;
+    if (void *memory = std::malloc(size == 0 ? 1 : size)) return memory;
+    throw std::bad_alloc();
+}
+
+void operator delete(void *memory) noexcept {
+    std::free(memory);
+}
+
+void operator delete(void *memory, size_t) noexcept {
+    std::free(memory);
+}
+
+volatile int64_t integerSink;
+volatile double doubleSink;
+volatile float floatSink;
+volatile size_t sizeSink;
+
+template<typename Function>
+double nanosPer(size_t rounds, Function &&function) {
+    using namespace std::chrono;
+    for (size_t round = 0; round < rounds / 10 + 1; ++round) function();
+    auto start = steady_clock::now();
+    for (size_t round = 0; round < rounds; ++round) function();
+    return duration<double, std::nano>(steady_clock::now() - start).count() / static_cast<double>(rounds);
+}
+
+template<typename Function>
+double allocationsPer(size_t rounds, Function &&function) {
+    function();
+    size_t before = allocations;
+    for (size_t round = 0; round < rounds; ++round) function();
+    return static_cast<double>(allocations - before) / static_cast<double>(rounds);
+}
+
+static void report(const char *name, double nanos) {
+    printf("%-40s %12.1f ns\n", name, nanos);
+}
+
+static std::string commandName(size_t index) {
+    char name[16];
+    snprintf(name, sizeof(name), "cmd%zu", index);
+    return name;
+}
+
+// count commands with no argument, plus the argument mix below
+static void registerCommands(CommandParser &parser, size_t count) {
+    for (size_t index = 0; index < count; ++index) {
+        parser.registerCommand(commandName(index), "", CommandParser::CommandViewCallback(
+                [](CommandParser::ArgumentSpan, Stream &) { return std::string(); }));
+    }
+    auto ignore = CommandParser::CommandViewCallback([](CommandParser::ArgumentSpan, Stream &) { return std::string(); });
+    parser.registerCommand("ints", "iiii", ignore);
+    parser.registerCommand("reals", "dddd", ignore);
+    parser.registerCommand("text", "ss", ignore);
+    parser.registerCommand("mixed", "sdiu", ignore);
+}
+
+struct Line {
+    const char *name;
+    const char *text;
+};
+
+static const Line lines[] = {
+        {"no argument", "cmd0"},
+        {"4 integers", "ints 1 -2 0x30 400000"},
+        {"4 doubles", "reals 1.5 -0.25 6.02e23 12345.6789"},
+        {"2 strings", "text hello \"quoted \\x41 string\""},
+        {"string double int uint", "mixed name -1.234e5 -123 0b1011"},
+        {"unknown command", "nothing 1 2"},
+};
+
+static void dispatch() {
+    printf("-- processCommand\n");
+    MockStream stream;
+    stream.discard = true;
+    std::string response;
+    std::string label;
+    for (size_t count : {8, 64, 256}) {
+        CommandParser parser;
+        registerCommands(parser, count);
+        std::string last = commandName(count - 1);
+        label = "last of " + std::to_string(count) + " commands";
+        report(label.c_str(), nanosPer(100000, [&] { parser.processCommand(last, response, stream); }));
+    }
+    CommandParser parser;
+    registerCommands(parser, 64);
+    for (auto &line : lines) {
+        std::string text = line.text;
+        report(line.name, nanosPer(100000, [&] { parser.processCommand(text, response, stream); }));
+    }
+}
+
+static void completion() {
+    printf("-- completion\n");
+    CommandParser parser;
+    registerCommands(parser, 256);
+    std::string prefix;
+    for (const char *typed : {"cmd25", "cmd1", "m"}) {
+        std::string label = std::string("tab_complete \"") + typed + "\"";
+        report(label.c_str(), nanosPer(10000, [&] {
+            auto candidates = parser.tab_complete(typed);
+            sizeSink = std::get<1>(candidates).size();
+        }));
+        label = std::string("complete \"") + typed + "\" with a visitor";
+        report(label.c_str(), nanosPer(10000, [&] { sizeSink = parser.complete(typed, prefix); }));
+    }
+}
+
+static const char *integers[] = {"0", "42", "-17", "123456789", "-9876543210", "0x7FFF", "0b101010", "9223372036854775807"};
+static const char *reals[] = {"0", "1.5", "-0.25", "3.14159", "-273.15", "6.02e23", "1e-9", "12345.6789"};
+
+static void numbers() {
+    printf("-- numbers, per list of 8\n");
+    report("strToInt<int64_t>", nanosPer(100000, [] {
+        for (auto text : integers) {
+            int64_t value = 0;
+            strToInt<int64_t>(text, &value, INT64_MIN, INT64_MAX);
+            integerSink = value;
+        }
+    }));
+    report("strtoll", nanosPer(100000, [] {
+        for (auto text : integers) integerSink = strtoll(text, nullptr, 0);
+    }));
+    report("parse_float<double>", nanosPer(100000, [] {
+        for (auto text : reals) {
+            double value = 0;
+            parse_float(text, text + strlen(text), value);
+            doubleSink = value;
+        }
+    }));
+    report("strtod", nanosPer(100000, [] {
+        for (auto text : reals) doubleSink = strtod(text, nullptr);
+    }));
+    report("parse_float<float>", nanosPer(100000, [] {
+        for (auto text : reals) {
+            float value = 0;
+            parse_float(text, text + strlen(text), value);
+            floatSink = value;
+        }
+    }));
+    report("strtof", nanosPer(100000, [] {
+        for (auto text : reals) floatSink = strtof(text, nullptr);
+    }));
+}
+
+static void paste() {
+    printf("-- handle_commandline, pasted input\n");
+    CommandParser parser;
+    registerCommands(parser, 64);
+    MockStream stream;
+    stream.discard = true;
+    stream.txRoom = 1 << 16;
+    CommandLineHandler handler(parser, stream);
+    std::string block;
+    for (int index = 0; index < 2000; ++index) block += "ints 1 -2 0x30 400000\r";
+    for (bool echo : {true, false}) {
+        handler.setEcho(echo);
+        stream.feed(block);
+        auto start = std::chrono::steady_clock::now();
+        while (stream.available() > 0) handler.handle_commandline();
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        printf("%-40s %12.0f bytes/s\n", echo ? "echo on" : "echo off", static_cast<double>(block.size()) / seconds);
+    }
+}
+
+static void heap() {
+    printf("-- heap allocations per command\n");
+    CommandParser parser;
+    registerCommands(parser, 64);
+    MockStream stream;
+    stream.discard = true;
+    std::string response;
+    response.reserve(MAX_RESPONSE_SIZE);
+    for (auto &line : lines) {
+        std::string text = line.text;
+        printf("%-40s %12.2f\n", line.name, allocationsPer(1000, [&] { parser.processCommand(text, response, stream); }));
+    }
+    stream.txRoom = 1 << 16;
+    CommandLineHandler handler(parser, stream);
+    printf("%-40s %12.2f\n", "typed through CommandLineHandler", allocationsPer(1000, [&] {
+        stream.feed("ints 1 -2 0x30 400000\r");
+        while (stream.available() > 0) handler.handle_commandline();
+    }));
+}
+
+int main() {
+#ifdef COMMAND_PARSER_FIXED_MEMORY
+    printf("COMMAND_PARSER_FIXED_MEMORY\n");
+#endif
+    dispatch();
+    completion();
+    numbers();
+    paste();
+    heap();
+    return 0;
+}
@@ -0,0 +1,346 @@
+//
+// Created by fogoz on 14/10/2026.
+//
+
+#ifndef PAMITEENSY_BINARYCOMMANDHANDLER_H
+#define PAMITEENSY_BINARYCOMMANDHANDLER_H
+#include "cstring"
+#include "CommandParser.h"
+#include "MathSnapshot.h"
+
+/*
+ * Binary framing over the same registry as CommandLineHandler, meant for machine to machine traffic.
+ * All integers are little-endian.
+ *   request  : 0xA5 | length u16 | id u16 | payload | crc8
+ *   response : 0x5A | length u16 | id u16 | status u8 | response text | crc8
+ * length counts the bytes between it and the crc, the crc (CRC-8, polynomial 0x07) covers length and those bytes.
+ * Command payload: the arguments in argTypes order, d as an IEEE-754 double, i/u as 8 byte integers, s as a u16 length
+ * followed by the bytes. Arguments after 'o' can be left out from the end.
+ * MathCommand payload: the MathOP as u8, then its operands as doubles (none for EMPTY, see CommandParser::mathOperandCount).
+ * Id 0xFFFE, with a MathSnapshot set, syncs every math variable in one frame: an empty payload answers a full snapshot,
+ * a single 1 byte the changed values only, a snapshot blob (see MathSnapshot.h) is restored.
+ * Values watched by this stream (see CommandParser::watch) arrive unrequested as id 0xFFFD frames, all the ones due in
+ * a turn in the same frame: id u16 | value double for each. Variables inside groups have no id here and are skipped.
+ * Id 0 lists the registry, each entry is id u16 | kind u8 (0 command, 1 math) | name length u8 | name | argTypes length u8 | argTypes
+ * An asynchronous command answers with status 3 (pending, empty text) then, once finished, with a second response
+ * carrying the same id and its real status. With an executor set on the parser every request is answered that way.
+ * Callbacks still get the stream, anything they print directly ends up between frames.
+ */
+#define BINARY_FRAME_MAX_SIZE 256
+#define BINARY_REQUEST_SYNC 0xA5
+#define BINARY_RESPONSE_SYNC 0x5A
+#define BINARY_DIRECTORY_ID 0
+#define BINARY_SNAPSHOT_ID 0xFFFE
+#define BINARY_WATCH_ID 0xFFFD
+
+#define BINARY_STATUS_OK 0
+#define BINARY_STATUS_ERROR 1
+#define BINARY_STATUS_BAD_FRAME 2
+#define BINARY_STATUS_PENDING 3
+
+inline uint8_t crc8_update(uint8_t crc, uint8_t byte) {
+    crc ^= byte;
+    for (int i = 0; i < 8; ++i) {
+        crc = (crc & 0x80) ? static_cast<uint8_t>((crc << 1) ^ 0x07) : static_cast<uint8_t>(crc << 1);
+    }
+    return crc;
+}
+
+class BinaryCommandHandler {
+    enum class State : uint8_t {
+        SYNC,
+        LENGTH_LOW,
+        LENGTH_HIGH,
+        BODY,
+        CRC
+    };
+
+    // Bounds checked little-endian reads over the payload of a frame
+    struct Reader {
+        const uint8_t *position;
+        const uint8_t *end;
+
+        bool empty() const { return position == end; }
+
+        bool read(uint64_t &value, size_t bytes) {
+            if (static_cast<size_t>(end - position) < bytes) return false;
+            value = 0;
+            for (size_t i = 0; i < bytes; ++i) value |= static_cast<uint64_t>(position[i]) << (8 * i);
+            position += bytes;
+            return true;
+        }
+
+        bool read(double &value) {
+            uint64_t bits;
+            if (!read(bits, 8)) return false;
+            memcpy(&value, &bits, sizeof(value));
+            return true;
+        }
+
+        bool read(std::string_view &value) {
+            uint64_t size;
+            if (!read(size, 2) || static_cast<size_t>(end - position) < size) return false;
+            value = std::string_view(reinterpret_cast<const char *>(position), size);
+            position += size;
+            return true;
+        }
+    };
+
+    CommandParser& parser;
+    Stream& stream;
+    MathSnapshot *snapshot = nullptr;
+    std::array<uint8_t, BINARY_FRAME_MAX_SIZE> frame;
+    std::vector<CommandParser::ArgumentView> args;
+    std::string response;
+    State state = State::SYNC;
+    uint16_t length = 0;
+    uint16_t received = 0;
+    uint8_t crc = 0;
+    uint8_t txCrc = 0;
+
+    void put(uint8_t byte) {
+        txCrc = crc8_update(txCrc, byte);
+        stream.write(byte);
+    }
+
+    void put(const void *data, size_t size) {
+        auto bytes = static_cast<const uint8_t *>(data);
+        for (size_t i = 0; i < size; ++i) txCrc = crc8_update(txCrc, bytes[i]);
+        stream.write(bytes, size);
+    }
+
+    void beginResponse(uint16_t id, uint8_t status, size_t payloadSize) {
+        stream.write(static_cast<uint8_t>(BINARY_RESPONSE_SYNC));
+        txCrc = 0;
+        uint16_t size = static_cast<uint16_t>(payloadSize + 3);
+        put(size & 0xFF);
+        put(size >> 8);
+        put(id & 0xFF);
+        put(id >> 8);
+        put(status);
+    }
+
+    void endResponse() {
+        stream.write(txCrc);
+    }
+
+    void sendResponse(uint16_t id, uint8_t status, std::string_view text) {
+        text = text.substr(0, 0xFFFF - 3);
+        beginResponse(id, status, text.size());
+        put(text.data(), text.size());
+        endResponse();
+    }
+
+    static size_t entrySize(std::string_view name, std::string_view argTypes) {
+        return 5 + std::min<size_t>(name.size(), 0xFF) + std::min<size_t>(argTypes.size(), 0xFF);
+    }
+
+    void putEntry(uint16_t id, bool isMath, std::string_view name, std::string_view argTypes) {
+        put(id & 0xFF);
+        put(id >> 8);
+        put(isMath ? 1 : 0);
+        uint8_t nameSize = std::min<size_t>(name.size(), 0xFF);
+        put(nameSize);
+        put(name.data(), nameSize);
+        uint8_t typesSize = std::min<size_t>(argTypes.size(), 0xFF);
+        put(typesSize);
+        put(argTypes.data(), typesSize);
+    }
+
+    static std::string_view argTypesOf(const CommandParser::BaseCommand &command, bool isMath) {
+        return isMath ? std::string_view() : std::string_view(static_cast<const CommandParser::Command &>(command).argTypes);
+    }
+
+    void sendDirectory() {
+        size_t size = 0;
+        parser.for_each_command([&size](const CommandParser::BaseCommand &command, bool isMath) {
+            size += entrySize(command.name, argTypesOf(command, isMath));
+        });
+        parser.for_each_static_command([&size](const CommandParser::StaticCommand &command, uint16_t) {
+            size += entrySize(command.name, command.argTypes);
+        });
+        beginResponse(BINARY_DIRECTORY_ID, BINARY_STATUS_OK, size);
+        parser.for_each_command([this](const CommandParser::BaseCommand &command, bool isMath) {
+            putEntry(command.id, isMath, command.name, argTypesOf(command, isMath));
+        });
+        parser.for_each_static_command([this](const CommandParser::StaticCommand &command, uint16_t id) {
+            putEntry(id, false, command.name, command.argTypes);
+        });
+        endResponse();
+    }
+
+    bool decodeArguments(std::string_view argTypes, Reader &reader) {
+        args.clear();
+        bool optional = false;
+        for (char argType : argTypes) {
+            if (argType == 'o') {
+                optional = true;
+                continue;
+            }
+            if (reader.empty() && optional) {
+                args.emplace_back();
+                continue;
+            }
+            bool decoded = false;
+            switch (argType) {
+                case 'd': {
+                    double value;
+                    decoded = reader.read(value);
+                    if (decoded) args.emplace_back(value);
+                    break;
+                }
+                case 'u': {
+                    uint64_t value;
+                    decoded = reader.read(value, 8);
+                    if (decoded) args.emplace_back(value);
+                    break;
+                }
+                case 'i': {
+                    uint64_t value;
+                    decoded = reader.read(value, 8);
+                    if (decoded) args.emplace_back(static_cast<int64_t>(value));
+                    break;
+                }
+                case 's': {
+                    std::string_view value;
+                    decoded = reader.read(value);
+                    if (decoded) args.emplace_back(value);
+                    break;
+                }
+            }
+            if (!decoded) return false;
+        }
+        return reader.empty();
+    }
+
+    void processFrame() {
+        uint16_t id = frame[0] | (frame[1] << 8);
+        Reader reader{frame.data() + 2, frame.data() + length};
+        response.clear();
+        if (id == BINARY_DIRECTORY_ID) {
+            sendDirectory();
+            return;
+        }
+        if (id == BINARY_SNAPSHOT_ID && snapshot != nullptr) {
+            processSnapshot(reader);
+            return;
+        }
+        bool ok;
+        auto command = parser.command_by_id(id);
+        auto staticCommand = command == nullptr ? parser.static_command_by_id(id) : nullptr;
+        if (command != nullptr || staticCommand != nullptr) {
+            if (!decodeArguments(command != nullptr ? std::string_view(command->argTypes) : staticCommand->argTypes, reader)) {
+                sendResponse(id, BINARY_STATUS_BAD_FRAME, PSTR("Error: Invalid binary arguments."));
+                return;
+            }
+            ok = parser.invoke(id, CommandParser::ArgumentSpan{args.data(), args.size()}, response, stream);
+        } else if (parser.math_command_by_id(id) != nullptr) {
+            uint64_t op;
+            double operands[MAX_MATH_OPERANDS];
+            int operandCount = reader.read(op, 1) ? parser.mathOperandCount(static_cast<MathOP>(op)) : -1;
+            bool decoded = operandCount >= 0;
+            for (int i = 0; decoded && i < operandCount; ++i) decoded = reader.read(operands[i]);
+            if (!decoded || !reader.empty()) {
+                sendResponse(id, BINARY_STATUS_BAD_FRAME, PSTR("Error: Invalid binary math command."));
+                return;
+            }
+            ok = parser.invokeMath(id, static_cast<MathOP>(op), operands, response, stream);
+        } else {
+            sendResponse(id, BINARY_STATUS_ERROR, commandErrorMessage(ERROR_UNKNOWN_COMMAND));
+            return;
+        }
+        bool deferred = ok && ((command != nullptr && command->asyncCallback) || parser.has_executor());
+        sendResponse(id, deferred ? BINARY_STATUS_PENDING : ok ? BINARY_STATUS_OK : BINARY_STATUS_ERROR, response);
+    }
+
+    void processSnapshot(const Reader &reader) {
+        size_t size = reader.end - reader.position;
+        if (size == 0 || (size == 1 && reader.position[0] == 1)) {
+            if (size == 0) snapshot->write(response);
+            else snapshot->write_changed(response);
+            sendResponse(BINARY_SNAPSHOT_ID, BINARY_STATUS_OK, response);
+            return;
+        }
+        if (!snapshot->restore(std::string_view(reinterpret_cast<const char *>(reader.position), size))) {
+            sendResponse(BINARY_SNAPSHOT_ID, BINARY_STATUS_BAD_FRAME, PSTR("Error: Invalid snapshot."));
+            return;
+        }
+        sendResponse(BINARY_SNAPSHOT_ID, BINARY_STATUS_OK, {});
+    }
+
+    void sendWatches() {
+        response.clear();
+        parser.poll_watches(stream, micros(), [this](const CommandParser::MathCommand &command, std::string_view path) {
+            // Only the root's variables have ids on this protocol, a group's are watched from text
+            if (path.size() != command.name.size()) return;
+            uint8_t entry[10];
+            entry[0] = command.id & 0xFF;
+            entry[1] = command.id >> 8;
+            double value = command.value.get();
+            memcpy(entry + 2, &value, sizeof(value));
+            response.append(reinterpret_cast<const char *>(entry), sizeof(entry));
+        });
+        if (!response.empty()) sendResponse(BINARY_WATCH_ID, BINARY_STATUS_OK, response);
+    }
+
+    void feed(uint8_t byte) {
+        switch (state) {
+            case State::SYNC:
+                if (byte == BINARY_REQUEST_SYNC) {
+                    state = State::LENGTH_LOW;
+                    crc = 0;
+                }
+                break;
+            case State::LENGTH_LOW:
+                length = byte;
+                crc = crc8_update(crc, byte);
+                state = State::LENGTH_HIGH;
+                break;
+            case State::LENGTH_HIGH:
+                length |= byte << 8;
+                crc = crc8_update(crc, byte);
+                received = 0;
+                if (length < 2 || length > frame.size()) {
+                    sendResponse(0xFFFF, BINARY_STATUS_BAD_FRAME, PSTR("Error: Invalid frame length."));
+                    state = State::SYNC;
+                } else {
+                    state = State::BODY;
+                }
+                break;
+            case State::BODY:
+                frame[received++] = byte;
+                crc = crc8_update(crc, byte);
+                if (received == length) state = State::CRC;
+                break;
+            case State::CRC:
+                state = State::SYNC;
+                if (byte != crc) {
+                    sendResponse(frame[0] | (frame[1] << 8), BINARY_STATUS_BAD_FRAME, PSTR("Error: Invalid frame checksum."));
+                    break;
+                }
+                processFrame();
+                break;
+        }
+    }
+
+public:
+    BinaryCommandHandler(CommandParser& parser, Stream& stream): parser(parser), stream(stream) {}
+
+    // Answers BINARY_SNAPSHOT_ID with it, restores are bounded by BINARY_FRAME_MAX_SIZE so large sets go as deltas
+    void setSnapshot(MathSnapshot *newSnapshot) {
+        snapshot = newSnapshot;
+    }
+
+    // Same polling model as CommandLineHandler::handle_commandline, a partial frame is kept for the next call
+    void handle_frames() {
+        while (stream.available()) {
+            feed(stream.read());
+        }
+        while (auto result = parser.take_finished(stream, response)) {
+            sendResponse(result->id, result->ok ? BINARY_STATUS_OK : BINARY_STATUS_ERROR, response);
+        }
+        sendWatches();
+        stream.flush();
+    }
+};
+#endif //PAMITEENSY_BINARYCOMMANDHANDLER_H
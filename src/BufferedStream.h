@@ -0,0 +1,95 @@
+//
+// Created by fogoz on 14/10/2026.
+//
+
+#ifndef PAMITEENSY_BUFFEREDSTREAM_H
+#define PAMITEENSY_BUFFEREDSTREAM_H
+#include "Arduino.h"
+#include "algorithm"
+#include "array"
+
+#ifndef BUFFERED_STREAM_SIZE
+#define BUFFERED_STREAM_SIZE 256
+#endif
+
+// Bytes are pushed out once the oldest buffered one has waited this long, even without an explicit flush
+#ifndef BUFFERED_STREAM_FLUSH_MICROS
+#define BUFFERED_STREAM_FLUSH_MICROS 2000
+#endif
+
+// Stream wrapper collecting writes in a ring buffer so they leave in a few large writes instead of one per character.
+// Reads go straight to the wrapped stream. Data is sent when the ring is full, when the time budget expires and on flush().
+class BufferedStream : public Stream {
+    Stream *stream;
+    std::array<uint8_t, BUFFERED_STREAM_SIZE> buffer;
+    size_t tail = 0;
+    size_t count = 0;
+    unsigned long oldest = 0;
+    unsigned long budget;
+
+    // Writes the buffered bytes in at most two contiguous chunks
+    void drain() {
+        while (count > 0) {
+            size_t chunk = std::min(count, buffer.size() - tail);
+            stream->write(buffer.data() + tail, chunk);
+            tail = (tail + chunk) % buffer.size();
+            count -= chunk;
+        }
+        tail = 0;
+    }
+
+public:
+    using Print::write;
+
+    BufferedStream(Stream& stream, unsigned long budgetMicros = BUFFERED_STREAM_FLUSH_MICROS) : stream(&stream), budget(budgetMicros) {}
+
+    int available() override { return stream->available(); }
+
+    int read() override { return stream->read(); }
+
+    int peek() override { return stream->peek(); }
+
+    size_t write(uint8_t c) override {
+        if (count == buffer.size()) drain();
+        if (count == 0) oldest = micros();
+        buffer[(tail + count) % buffer.size()] = c;
+        count++;
+        poll();
+        return 1;
+    }
+
+    size_t write(const uint8_t *data, size_t size) override {
+        // Too large to ever fit, send what is queued then the data directly
+        if (size >= buffer.size()) {
+            drain();
+            return stream->write(data, size);
+        }
+        for (size_t i = 0; i < size; ++i) write(data[i]);
+        return size;
+    }
+
+    int availableForWrite() override {
+        return static_cast<int>(buffer.size() - count);
+    }
+
+    // Sends the buffered bytes once the time budget expired, call it from loops that may not flush for a while
+    void poll() {
+        if (count > 0 && micros() - oldest >= budget) drain();
+    }
+
+    void flush() override {
+        drain();
+        stream->flush();
+    }
+
+    Stream& wrapped() {
+        return *stream;
+    }
+
+    // Sends what is buffered for the current stream, then wraps next. One buffer can so serve several links in turn.
+    void retarget(Stream& next) {
+        drain();
+        stream = &next;
+    }
+};
+#endif //PAMITEENSY_BUFFEREDSTREAM_H
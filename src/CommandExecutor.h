@@ -0,0 +1,96 @@
+//
+// Created by fogoz on 14/10/2026.
+//
+
+#ifndef PAMITEENSY_COMMANDEXECUTOR_H
+#define PAMITEENSY_COMMANDEXECUTOR_H
+#include "CommandParser.h"
+#include "LockFreeRing.h"
+
+/*
+ * Executors for CommandParser::setExecutor, to keep line editing, echo and completion on one core (or task) while the
+ * callbacks run on another. The handler core only queues the line, the other one calls run() from its own loop:
+ *   QueueExecutor<> executor;
+ *   parser.setExecutor(&executor);
+ *   // core 1 / FreeRTOS task
+ *   while (true) executor.run(parser, Serial2);
+ * Each line holds one of the parser's COMMAND_PARSER_MAX_PENDING slots until its result has been printed. Batches and
+ * lines longer than LineSize wait in that slot, the queue then only carries their token.
+ */
+
+// Lines run in the order they were typed
+template<size_t Jobs = COMMAND_PARSER_MAX_PENDING, size_t LineSize = MAX_COMMAND_LINE_SIZE>
+class QueueExecutor : public CommandParser::Executor {
+    MpscLineQueue<Jobs, LineSize> queue;
+    std::string line;
+    std::string response;
+
+public:
+    QueueExecutor() {
+        line.reserve(LineSize);
+        response.reserve(MAX_RESPONSE_SIZE);
+    }
+
+    bool submit(std::string_view text, CommandParser::AsyncToken token, uint8_t) override {
+        return queue.push(text, token.value());
+    }
+
+    size_t max_line_size() const override {
+        return LineSize;
+    }
+
+    // On the executing core: runs up to maxJobs queued lines, all of them when 0. Callbacks get stream.
+    size_t run(CommandParser &parser, Stream &stream, size_t maxJobs = 0) {
+        size_t jobs = 0;
+        uint16_t tag;
+        while ((maxJobs == 0 || jobs < maxJobs) && queue.pop(line, tag)) {
+            parser.run_submitted(line, CommandParser::AsyncToken::from(tag), response, stream);
+            jobs++;
+        }
+        return jobs;
+    }
+};
+
+// One queue per priority (see CommandParser::set_priority), the highest non empty one is served first. Priorities
+// from Levels on share the highest queue.
+template<size_t Levels = 2, size_t Jobs = COMMAND_PARSER_MAX_PENDING, size_t LineSize = MAX_COMMAND_LINE_SIZE>
+class PriorityExecutor : public CommandParser::Executor {
+    static_assert(Levels > 0, "PriorityExecutor needs at least one level");
+
+    std::array<MpscLineQueue<Jobs, LineSize>, Levels> queues;
+    std::string line;
+    std::string response;
+
+    bool take(uint16_t &tag) {
+        for (size_t level = Levels; level-- > 0;) {
+            if (queues[level].pop(line, tag)) return true;
+        }
+        return false;
+    }
+
+public:
+    PriorityExecutor() {
+        line.reserve(LineSize);
+        response.reserve(MAX_RESPONSE_SIZE);
+    }
+
+    bool submit(std::string_view text, CommandParser::AsyncToken token, uint8_t priority) override {
+        return queues[priority < Levels ? priority : Levels - 1].push(text, token.value());
+    }
+
+    size_t max_line_size() const override {
+        return LineSize;
+    }
+
+    // Same as QueueExecutor::run, the priority is checked again before every line
+    size_t run(CommandParser &parser, Stream &stream, size_t maxJobs = 0) {
+        size_t jobs = 0;
+        uint16_t tag;
+        while ((maxJobs == 0 || jobs < maxJobs) && take(tag)) {
+            parser.run_submitted(line, CommandParser::AsyncToken::from(tag), response, stream);
+            jobs++;
+        }
+        return jobs;
+    }
+};
+#endif //PAMITEENSY_COMMANDEXECUTOR_H
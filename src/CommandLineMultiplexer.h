@@ -0,0 +1,100 @@
+//
+// Created by fogoz on 14/10/2026.
+//
+
+#ifndef PAMITEENSY_COMMANDLINEMULTIPLEXER_H
+#define PAMITEENSY_COMMANDLINEMULTIPLEXER_H
+#include "array"
+#include "optional"
+#include "CommandParser.h"
+
+#ifndef MULTIPLEXER_MAX_SESSIONS
+#define MULTIPLEXER_MAX_SESSIONS 4
+#endif
+
+// Default share of one session per round, a flooded link gives the hand back after this much
+#ifndef MULTIPLEXER_SESSION_BYTES
+#define MULTIPLEXER_SESSION_BYTES 64
+#endif
+
+#ifndef MULTIPLEXER_SESSION_COMMANDS
+#define MULTIPLEXER_SESSION_COMMANDS 1
+#endif
+
+// Several terminals (USB serial, radio UART, TCP...) over one CommandParser. A single CommandLineHandler, with its
+// output buffer and the history, serves every session in turn. A session only holds what its link needs between two
+// turns (see CommandLineSession) and gets a bounded turn per round so none can starve the others.
+class CommandLineMultiplexer {
+    struct Slot {
+        CommandLineSession session;
+        CommandLineBudget budget;
+        size_t backlog = 0;
+    };
+
+    CommandParser& parser;
+    // Built with the first session, it needs a stream to wrap
+    std::optional<CommandLineHandler> handler;
+    std::array<Slot, MULTIPLEXER_MAX_SESSIONS> slots;
+    size_t count = 0;
+    size_t first = 0;
+    CommandLineBudget defaultBudget;
+    size_t historyBytes;
+
+public:
+    // The sessions share the history ring of historyBytes, each line is reserved at the lineSize given to add()
+    explicit CommandLineMultiplexer(CommandParser& parser,
+                                    CommandLineBudget budget = CommandLineBudget{0, MULTIPLEXER_SESSION_BYTES, MULTIPLEXER_SESSION_COMMANDS},
+                                    size_t historyBytes = COMMAND_HISTORY_BYTES)
+        : parser(parser), defaultBudget(budget), historyBytes(historyBytes) {}
+
+    // Returns the index of the new session, -1 once MULTIPLEXER_MAX_SESSIONS are open
+    int add(Stream& stream, size_t sessionLineSize = MAX_COMMAND_LINE_SIZE) {
+        if (count == slots.size()) return -1;
+        // Its completion and response buffers are shared, sized for the usual line
+        if (!handler) handler.emplace(parser, stream, std::max<size_t>(MAX_COMMAND_LINE_SIZE, sessionLineSize), historyBytes);
+        auto &slot = slots[count];
+        slot.session.link = &stream;
+        slot.session.line.reserve(sessionLineSize);
+#ifdef COMMAND_PARSER_FIXED_MEMORY
+        // The search buffers are only grown on use otherwise
+        slot.session.searchText.reserve(sessionLineSize);
+        slot.session.savedLine.reserve(sessionLineSize);
+#endif
+        slot.budget = defaultBudget;
+        return static_cast<int>(count++);
+    }
+
+    size_t size() const {
+        return count;
+    }
+
+    // The stream commands of this session see, watch through the parser with it
+    CommandLineSession& session(size_t index) {
+        return slots[index].session;
+    }
+
+    void setBudget(size_t index, const CommandLineBudget& budget) {
+        slots[index].budget = budget;
+    }
+
+    // Bytes that were still waiting on this session after its last turn
+    size_t backlog(size_t index) const {
+        return slots[index].backlog;
+    }
+
+    // One round: every session with input gets a turn bounded by its budget. The session served first rotates so the
+    // same link doesn't always go first. Returns the number of bytes still waiting over all sessions.
+    size_t handle_sessions() {
+        size_t waiting = 0;
+        for (size_t i = 0; i < count; ++i) {
+            auto &slot = slots[(first + i) % count];
+            handler->attach(slot.session);
+            slot.backlog = handler->handle_commandline(slot.budget);
+            handler->detach(slot.session);
+            waiting += slot.backlog;
+        }
+        if (count != 0) first = (first + 1) % count;
+        return waiting;
+    }
+};
+#endif //PAMITEENSY_COMMANDLINEMULTIPLEXER_H
@@ -5,20 +5,256 @@
 #ifndef __COMMAND_PARSER_H__
 #define __COMMAND_PARSER_H__
 
+#include <array>
+#include <atomic>
 #include <limits>
 #include <string>
+#include <string_view>
 #include <variant>
 #include <vector>
 #include <functional>
 #include <cctype>
+#include <cstdarg>
 #include <cstdio>
+#include <cstring>
+#include <cmath>
 #include <algorithm>
 #include <memory>
-
+#include <optional>
+#include <tuple>
+#include <type_traits>
+#include <unordered_map>
+
+#include "BufferedStream.h"
+#include "CommandTrie.h"
+#include "FastNumber.h"
 #include "RoundArray.h"
 #include "StateMachine.h"
 
+#ifndef MAX_RESPONSE_SIZE
 #define MAX_RESPONSE_SIZE 128
+#endif
+
+// Capacity reserved up front for the line being typed
+#ifndef MAX_COMMAND_LINE_SIZE
+#define MAX_COMMAND_LINE_SIZE 128
+#endif
+
+// Size of the history ring, in bytes, each entry takes its length plus 4
+#ifndef COMMAND_HISTORY_BYTES
+#define COMMAND_HISTORY_BYTES 512
+#endif
+
+// Asynchronous commands that can be running at once, one more is refused until a result has been delivered
+#ifndef COMMAND_PARSER_MAX_PENDING
+#define COMMAND_PARSER_MAX_PENDING 4
+#endif
+
+// Longest line or batch handed to an executor. Ones its queue can't hold wait in their pending slot, longer are refused.
+#ifndef COMMAND_PARSER_MAX_SUBMITTED_SIZE
+#define COMMAND_PARSER_MAX_SUBMITTED_SIZE 1024
+#endif
+
+// Math variables watched at once, over every stream of the parser
+#ifndef COMMAND_PARSER_MAX_WATCHES
+#define COMMAND_PARSER_MAX_WATCHES 8
+#endif
+
+#ifndef COMMAND_PARSER_WATCH_COMMAND
+#define COMMAND_PARSER_WATCH_COMMAND "watch"
+#endif
+
+// Most a streaming command writes per handle_commandline call
+#ifndef RESPONSE_CHUNK_SIZE
+#define RESPONSE_CHUNK_SIZE 64
+#endif
+
+// Stack buffer of ResponseWriter::printf, longer lines are cut
+#ifndef RESPONSE_WRITER_FORMAT_SIZE
+#define RESPONSE_WRITER_FORMAT_SIZE 96
+#endif
+
+#define TERMINAL_REVERSE_SEARCH 0x12
+#define TERMINAL_CANCEL 0x07
+
+// Every error the parser itself answers with, the operator one is followed by the operator name
+#define COMMAND_ERRORS \
+COMMAND_ERROR(UNKNOWN_COMMAND, "Error: Unknown command.") \
+COMMAND_ERROR(INVALID_DOUBLE, "Error: Invalid double argument.") \
+COMMAND_ERROR(INVALID_UNSIGNED, "Error: Invalid unsigned integer argument.") \
+COMMAND_ERROR(INVALID_INTEGER, "Error: Invalid integer argument.") \
+COMMAND_ERROR(INVALID_STRING, "Error: Invalid string argument.") \
+COMMAND_ERROR(TOO_MANY_ARGUMENTS, "Error: Too many arguments provided.") \
+COMMAND_ERROR(UNKNOWN_OPERATOR, "Unknown operator ! ") \
+COMMAND_ERROR(MISSING_MATH_VALUE, "Error: Invalid math command please add value.") \
+COMMAND_ERROR(DIVISION_BY_ZERO, "Error: Division by zero.") \
+COMMAND_ERROR(TOO_MANY_PENDING, "Error: Too many pending commands.") \
+COMMAND_ERROR(MISSING_SUBCOMMAND, "Error: Missing subcommand.") \
+COMMAND_ERROR(MACRO_RECURSION, "Error: Macro runs itself.") \
+COMMAND_ERROR(TOO_MANY_WATCHES, "Error: Too many watches.") \
+COMMAND_ERROR(LINE_TOO_LONG, "Error: Line too long.")
+#define COMMAND_ERROR(name, message) ERROR_##name,
+enum CommandError {
+    COMMAND_ERRORS
+    CommandErrorCount
+};
+#undef COMMAND_ERROR
+#define COMMAND_ERROR(name, message) message,
+
+inline constexpr const char *commandError_messages[] = {
+    COMMAND_ERRORS
+};
+#undef COMMAND_ERROR
+#define COMMAND_ERROR(name, message) #name,
+
+inline constexpr const char *commandError_names[] = {
+    COMMAND_ERRORS
+};
+#undef COMMAND_ERROR
+
+inline const char *commandErrorMessage(CommandError error) {
+    return commandError_messages[error];
+}
+
+// Error a failed response starts with, CommandErrorCount when it is none of them
+inline CommandError commandErrorFromResponse(std::string_view response) {
+    for (size_t i = 0; i < CommandErrorCount; ++i) {
+        std::string_view message = commandError_messages[i];
+        if (response.substr(0, message.size()) == message) return static_cast<CommandError>(i);
+    }
+    return CommandErrorCount;
+}
+
+// Define COMMAND_PARSER_PROFILING to count calls, errors and time per command (see CommandParser::stats), the
+// counters and the "stats" command only exist in that build
+#ifndef COMMAND_PARSER_STATS_COMMAND
+#define COMMAND_PARSER_STATS_COMMAND "stats"
+#endif
+
+// Name of the optional command defining macros at runtime, see CommandParser::register_macro_command
+#ifndef COMMAND_PARSER_MACRO_COMMAND
+#define COMMAND_PARSER_MACRO_COMMAND "macro"
+#endif
+
+// $1 to $9 in a macro body, $* takes every argument of the call
+#define MACRO_MAX_PARAMETERS 9
+
+#ifdef COMMAND_PARSER_PROFILING
+// Time is in micros, parse covers lookup and argument parsing, callback the callback only. Typed commands parse
+// inside their invoker, their parsing counts as callback time.
+struct CommandStats {
+    uint32_t calls = 0;
+    uint32_t errors = 0;
+    uint32_t parseMicros = 0;
+    uint32_t callbackMicros = 0;
+    uint32_t maxCallbackMicros = 0;
+};
+
+struct ParserStats {
+    uint32_t lines = 0;
+    // Indexed by CommandError, the last slot counts failures answered with any other text
+    uint32_t errors[CommandErrorCount + 1] = {};
+    size_t peakResponseSize = 0;
+};
+#define PROFILE_COMMAND(command) profileCommand((command).stats)
+#define PROFILE_CALLBACK() profileCallback()
+#else
+#define PROFILE_COMMAND(command)
+#define PROFILE_CALLBACK()
+#endif
+
+// Define COMMAND_PARSER_FIXED_MEMORY to keep every buffer of CommandLineHandler at the capacity reserved by its
+// constructor: longer lines are refused and responses are cut at MAX_RESPONSE_SIZE.
+// Once setup() registered everything, neither class allocates by itself, as long as the callbacks write their
+// response through a ResponseBuffer (or return strings short enough for the small string optimisation).
+
+// Appends to a response string without ever growing it past its limit, text beyond it is dropped.
+// The string is reserved to the limit, so writing to it never allocates.
+class ResponseBuffer {
+    std::string &text;
+    size_t limit;
+    bool cut = false;
+
+public:
+    ResponseBuffer(std::string &text, size_t limit = MAX_RESPONSE_SIZE) : text(text), limit(limit) {
+        text.reserve(limit);
+    }
+
+    ResponseBuffer &append(std::string_view data) {
+        size_t room = limit - std::min(limit, text.size());
+        if (data.size() > room) cut = true;
+        text.append(data.data(), std::min(room, data.size()));
+        return *this;
+    }
+
+    ResponseBuffer &append(char c) {
+        return append(std::string_view(&c, 1));
+    }
+
+    // printf into the remaining room, without a temporary string
+    ResponseBuffer &printf(const char *format, ...) __attribute__((format(printf, 2, 3))) {
+        if (text.size() >= limit) {
+            cut = true;
+            return *this;
+        }
+        size_t used = text.size();
+        size_t room = limit - used;
+        text.resize(limit);
+        va_list args;
+        va_start(args, format);
+        // vsnprintf needs room for its null, which lands on the string's own terminator when the buffer is full
+        int written = vsnprintf(text.data() + used, room + 1, format, args);
+        va_end(args);
+        if (written < 0) written = 0;
+        if (static_cast<size_t>(written) > room) {
+            cut = true;
+            written = static_cast<int>(room);
+        }
+        text.resize(used + written);
+        return *this;
+    }
+
+    [[nodiscard]] bool truncated() const { return cut; }
+
+    [[nodiscard]] size_t size() const { return text.size(); }
+};
+
+// Output of a streaming command for one turn, written straight to the stream within room(). Every write is all or
+// nothing: a piece that doesn't fit is refused, as is everything after it, and is meant to be written again next turn.
+class ResponseWriter {
+    Stream &stream;
+    size_t left;
+    bool refused = false;
+
+public:
+    ResponseWriter(Stream &stream, size_t room) : stream(stream), left(room) {}
+
+    bool write(std::string_view data) {
+        if (refused || data.size() > left) {
+            refused = true;
+            return false;
+        }
+        stream.write(reinterpret_cast<const uint8_t *>(data.data()), data.size());
+        left -= data.size();
+        return true;
+    }
+
+    bool printf(const char *format, ...) __attribute__((format(printf, 2, 3))) {
+        if (refused) return false;
+        char line[RESPONSE_WRITER_FORMAT_SIZE];
+        va_list args;
+        va_start(args, format);
+        int written = vsnprintf(line, sizeof(line), format, args);
+        va_end(args);
+        if (written < 0) written = 0;
+        return write(std::string_view(line, std::min(static_cast<size_t>(written), sizeof(line) - 1)));
+    }
+
+    [[nodiscard]] size_t room() const { return refused ? 0 : left; }
+
+    // A write was refused, the generator should stop here and return false
+    [[nodiscard]] bool full() const { return refused; }
+};
 
 #define TERMINAL_END_LINE_WITH_LINE_FEED 1
 #define TERMINAL_END_LINE_WITH_CARRIAGE_RETURN 2
@@ -45,23 +281,88 @@ enum MathOP {
 #undef MATHOP
 #define MATHOP(name, str) #str,
 
-inline static std::string mathOP_names[] = {
+// Kept in flash, no std::string is built at startup
+inline constexpr const char *mathOP_names[] = {
     MATHOPS
 };
+#undef MATHOP
+
+// Open addressing table from operator name to MathOP, built at compile time
+#define MATHOP_BUCKETS 16
+
+constexpr size_t mathOPHash(std::string_view name) {
+    return name.empty() ? 0 : (static_cast<uint8_t>(name.front()) * 31u + static_cast<uint8_t>(name.back()) * 7u + name.size()) % MATHOP_BUCKETS;
+}
+
+struct MathOPBuckets {
+    int8_t slot[MATHOP_BUCKETS];
+};
+
+constexpr MathOPBuckets makeMathOPBuckets() {
+    static_assert(MathOPCount < MATHOP_BUCKETS, "MATHOP_BUCKETS has to be larger than the number of operators");
+    MathOPBuckets buckets{};
+    for (auto &slot : buckets.slot) slot = -1;
+    for (int i = 0; i < MathOPCount; ++i) {
+        size_t h = mathOPHash(mathOP_names[i]);
+        while (buckets.slot[h] != -1) h = (h + 1) % MATHOP_BUCKETS;
+        buckets.slot[h] = static_cast<int8_t>(i);
+    }
+    return buckets;
+}
+
+inline constexpr MathOPBuckets mathOP_buckets = makeMathOPBuckets();
 
 inline static std::string mathOPToString(MathOP op) {
     if (op >= MathOP::MathOPCount || op < 0) return "Unknown";
     return mathOP_names[static_cast<int>(op)];
 }
 
-static MathOP stringToMathOP(const std::string& str) {
-    for (int i = 0; i < MathOPCount; ++i) {
-        if (str == mathOP_names[i])
-            return static_cast<MathOP>(i);
+inline MathOP stringToMathOP(std::string_view str) {
+    size_t h = mathOPHash(str);
+    for (size_t probe = 0; probe < MATHOP_BUCKETS; ++probe) {
+        int8_t slot = mathOP_buckets.slot[h];
+        if (slot < 0) break;
+        if (str == mathOP_names[slot]) return static_cast<MathOP>(slot);
+        h = (h + 1) % MATHOP_BUCKETS;
     }
     return MathOPCount;
 }
 
+#define MAX_MATH_OPERANDS 4
+
+// Operator registered at runtime with CommandParser::registerMathOperator, on top of the MATHOPS ones.
+// It works on the value converted to double, apply gets the current value and the operands and returns the new value.
+struct MathOperator {
+    const char *name;
+    uint8_t operands;
+    double (*apply)(double current, const double *operands);
+};
+
+// Ready made operators, e.g. parser.registerMathOperator(MathOperators::clamp) then "kp clamp 0 10"
+struct MathOperators {
+    static double minimum(double current, const double *operands) { return current < operands[0] ? current : operands[0]; }
+
+    static double maximum(double current, const double *operands) { return current > operands[0] ? current : operands[0]; }
+
+    static double bound(double current, const double *operands) {
+        if (current < operands[0]) return operands[0];
+        if (current > operands[1]) return operands[1];
+        return current;
+    }
+
+    static double flip(double current, const double *) { return current == 0 ? 1 : 0; }
+
+    // Moves towards operands[0] by the fraction operands[1]
+    static double interpolate(double current, const double *operands) { return current + (operands[0] - current) * operands[1]; }
+
+    static constexpr MathOperator min{"min", 1, &minimum};
+    static constexpr MathOperator max{"max", 1, &maximum};
+    static constexpr MathOperator clamp{"clamp", 2, &bound};
+    static constexpr MathOperator toggle{"toggle", 0, &flip};
+    static constexpr MathOperator lerp{"lerp", 2, &interpolate};
+};
+
+// Flat names for large sets, CommandParser::registerGroup nests them instead ("motor left pid kp")
 template <size_t N1, size_t N2, size_t N3>
 auto make_command_name(const char (&prefix)[N1], const char (&name)[N2], const char (&subname)[N3]) {
     std::array<char, N1 + N2 + N3 - 2> out = {};
@@ -73,82 +374,363 @@ auto make_command_name(const char (&prefix)[N1], const char (&name)[N2], const c
     return out;
 }
 
-class DoubleRef {
-public:
-    virtual ~DoubleRef() = default;
-    virtual double get() const = 0;
-    virtual void set(double value) = 0;
+#define MATH_VALUE_TYPES \
+MATH_VALUE_TYPE(INT8, int8_t) \
+MATH_VALUE_TYPE(UINT8, uint8_t) \
+MATH_VALUE_TYPE(INT16, int16_t) \
+MATH_VALUE_TYPE(UINT16, uint16_t) \
+MATH_VALUE_TYPE(INT32, int32_t) \
+MATH_VALUE_TYPE(UINT32, uint32_t) \
+MATH_VALUE_TYPE(INT64, int64_t) \
+MATH_VALUE_TYPE(UINT64, uint64_t) \
+MATH_VALUE_TYPE(FLOAT, float) \
+MATH_VALUE_TYPE(DOUBLE, double) \
+MATH_VALUE_TYPE(BOOL, bool)
+#define MATH_VALUE_TYPE(name, type) name,
+enum class MathValueType : uint8_t {
+    MATH_VALUE_TYPES
 };
+#undef MATH_VALUE_TYPE
+
+// Types are matched by size and signedness, so int and long both map to the fixed width type of the same size
 template<typename T>
-class DoubleRefImpl : public DoubleRef {
-    T& ref;
-public:
-    DoubleRefImpl(T& ref) : ref(ref) {}
-    double get() const override { return static_cast<double>(ref); }
-    void set(double value) override { ref = static_cast<T>(value); }
-};
+constexpr MathValueType math_value_type() {
+    static_assert(std::is_arithmetic_v<T>, "Math commands can only be bound to arithmetic variables");
+    static_assert(sizeof(T) <= 8, "Math commands can't be bound to types larger than 8 bytes");
+    if constexpr (std::is_same_v<T, bool>) return MathValueType::BOOL;
+    else if constexpr (std::is_floating_point_v<T>) return sizeof(T) == 4 ? MathValueType::FLOAT : MathValueType::DOUBLE;
+    else if constexpr (sizeof(T) == 1) return std::is_signed_v<T> ? MathValueType::INT8 : MathValueType::UINT8;
+    else if constexpr (sizeof(T) == 2) return std::is_signed_v<T> ? MathValueType::INT16 : MathValueType::UINT16;
+    else if constexpr (sizeof(T) == 4) return std::is_signed_v<T> ? MathValueType::INT32 : MathValueType::UINT32;
+    else return std::is_signed_v<T> ? MathValueType::INT64 : MathValueType::UINT64;
+}
 
+// Right hand side of a math operation, integers typed by the user stay integers so integer variables never touch doubles
+struct MathOperand {
+    bool integral = false;
+    int64_t integer = 0;
+    double real = 0;
 
+    MathOperand() = default;
 
-// Template to convert strings to integers with error handling
-// Supports both signed and unsigned integers
+    MathOperand(int64_t value) : integral(true), integer(value), real(0) {}
+
+    MathOperand(double value) : integral(false), integer(0), real(value) {}
+
+    template<typename T>
+    T as() const {
+        return integral ? static_cast<T>(integer) : static_cast<T>(real);
+    }
+};
+
+// Saturates to T's range instead of overflowing, the sign of the exact result picks the end
 template<typename T>
-size_t strToInt(const char *buf, T *value, T min_value, T max_value) {
-    size_t position = 0;
-    bool isNegative = false;
+T math_integer_pow(T base, int64_t exponent) {
+    bool negative = false;
+    if constexpr (std::is_signed_v<T>) negative = base < 0 && (exponent & 1);
+    T saturated = negative ? std::numeric_limits<T>::lowest() : std::numeric_limits<T>::max();
+    T result = 1;
+    while (exponent > 0) {
+        if ((exponent & 1) && __builtin_mul_overflow(result, base, &result)) return saturated;
+        exponent >>= 1;
+        // The square only overflows when the powers still to come would too
+        if (exponent > 0 && __builtin_mul_overflow(base, base, &base)) return saturated;
+    }
+    return result;
+}
+
+// Variable bound to a MathCommand, stored as a pointer and a type tag instead of a heap allocated virtual wrapper.
+// Operations run on the exact values, saturate to the variable's type and are clamped to the optional bounds in the
+// same step.
+struct MathValue {
+    void *target = nullptr;
+    MathValueType type = MathValueType::DOUBLE;
+    bool bounded = false;
+    // Bounds are stored in the variable's type, in the first bytes
+    alignas(8) uint8_t min[8] = {};
+    alignas(8) uint8_t max[8] = {};
+
+    MathValue() = default;
+
+    template<typename T>
+    explicit MathValue(T &value) : target(&value), type(math_value_type<T>()) {}
+
+    template<typename T>
+    void setBounds(T low, T high) {
+        static_assert(sizeof(T) <= sizeof(min), "bound too large");
+        memcpy(min, &low, sizeof(T));
+        memcpy(max, &high, sizeof(T));
+        bounded = true;
+    }
+
+    double get() const {
+        switch (type) {
+#define MATH_VALUE_TYPE(name, T) case MathValueType::name: return static_cast<double>(load<T>());
+            MATH_VALUE_TYPES
+#undef MATH_VALUE_TYPE
+        }
+        return 0;
+    }
+
+    void set(double value) {
+        apply(MathOP::SET, MathOperand(value));
+    }
+
+    // Returns false when the operation is impossible in the variable's type (integer division by zero)
+    bool apply(MathOP op, const MathOperand &operand) {
+        switch (type) {
+#define MATH_VALUE_TYPE(name, T) case MathValueType::name: return applyAs<T>(op, operand);
+            MATH_VALUE_TYPES
+#undef MATH_VALUE_TYPE
+        }
+        return false;
+    }
+
+    // Width of the variable in bytes, its raw bytes are what snapshots store
+    size_t size() const {
+        switch (type) {
+#define MATH_VALUE_TYPE(name, T) case MathValueType::name: return sizeof(T);
+            MATH_VALUE_TYPES
+#undef MATH_VALUE_TYPE
+        }
+        return 0;
+    }
+
+    void save(uint8_t *out) const {
+        memcpy(out, target, size());
+    }
+
+    // Shortest text reading back as the same value, of the bytes of save() when raw is given, of the variable otherwise
+    int format(char *out, size_t outSize, const uint8_t *raw = nullptr) const {
+        if (raw == nullptr) raw = static_cast<const uint8_t *>(target);
+        switch (type) {
+#define MATH_VALUE_TYPE(name, T) case MathValueType::name: { T value; memcpy(&value, raw, sizeof(T)); return formatAs(value, out, outSize); }
+            MATH_VALUE_TYPES
+#undef MATH_VALUE_TYPE
+        }
+        return 0;
+    }
+
+    // Bytes written by save(), clamped to the bounds like any operation
+    void restore(const uint8_t *in) {
+        switch (type) {
+#define MATH_VALUE_TYPE(name, T) case MathValueType::name: { T value; memcpy(&value, in, sizeof(T)); store<T>(value); break; }
+            MATH_VALUE_TYPES
+#undef MATH_VALUE_TYPE
+        }
+    }
+
+private:
+    template<typename T>
+    static int formatAs(T value, char *out, size_t size) {
+        if constexpr (std::is_floating_point_v<T>) {
+            return snprintf(out, size, "%.*g", std::numeric_limits<T>::max_digits10, static_cast<double>(value));
+        } else if constexpr (std::is_signed_v<T>) {
+            return snprintf(out, size, "%lld", static_cast<long long>(value));
+        } else {
+            return snprintf(out, size, "%llu", static_cast<unsigned long long>(value));
+        }
+    }
+
+    // memcpy keeps the access well defined when int is read through int32_t, it compiles to a plain load/store
+    template<typename T>
+    T load() const {
+        T value;
+        memcpy(&value, target, sizeof(T));
+        return value;
+    }
 
-    if (min_value < 0 && (buf[position] == '+' || buf[position] == '-')) {
-        isNegative = (buf[position] == '-');
-        position++;
+    template<typename T>
+    void store(T value) {
+        if (bounded) {
+            T low, high;
+            memcpy(&low, min, sizeof(T));
+            memcpy(&high, max, sizeof(T));
+            if (value < low) value = low;
+            if (value > high) value = high;
+        }
+        memcpy(target, &value, sizeof(T));
     }
 
-    int base = 10;
-    if (buf[position] == '0') {
-        if (buf[position + 1] == 'b') {
-            base = 2;
-            position += 2;
+    template<typename T>
+    static bool compute(T &current, MathOP op, T operand) {
+        switch (op) {
+            case MathOP::ADD: current += operand; break;
+            case MathOP::SUB: current -= operand; break;
+            case MathOP::MUL: current *= operand; break;
+            case MathOP::DIV: current /= operand; break;
+            case MathOP::MOD: current = std::fmod(current, operand); break;
+            case MathOP::POW: current = std::pow(current, operand); break;
+            case MathOP::SET: current = operand; break;
+            case MathOP::EMPTY: break;
+            default: return false;
         }
-        else if (buf[position + 1] == 'o') {
-            base = 8;
-            position += 2;
+        return true;
+    }
+
+    template<typename T>
+    static T saturate(int64_t value) {
+        if constexpr (std::is_signed_v<T>) {
+            if (value < static_cast<int64_t>(std::numeric_limits<T>::lowest())) return std::numeric_limits<T>::lowest();
+            if (value > static_cast<int64_t>(std::numeric_limits<T>::max())) return std::numeric_limits<T>::max();
+        } else {
+            if (value < 0) return 0;
+            if (static_cast<uint64_t>(value) > std::numeric_limits<T>::max()) return std::numeric_limits<T>::max();
         }
-        else if (buf[position + 1] == 'x') {
-            base = 16;
-            position += 2;
+        return static_cast<T>(value);
+    }
+
+    // A double result brought into T's range before the conversion, which would be undefined outside of it
+    template<typename T>
+    static bool narrow(double value, T &out) {
+        if (std::isnan(value)) return false;
+        if (value <= static_cast<double>(std::numeric_limits<T>::lowest())) out = std::numeric_limits<T>::lowest();
+        else if (value >= static_cast<double>(std::numeric_limits<T>::max())) out = std::numeric_limits<T>::max();
+        else out = static_cast<T>(value);
+        return true;
+    }
+
+    // Integer operations on the exact values, a result outside of T saturates instead of wrapping
+    template<typename T>
+    static bool computeInteger(T &current, MathOP op, int64_t operand) {
+        constexpr T lowest = std::numeric_limits<T>::lowest();
+        constexpr T highest = std::numeric_limits<T>::max();
+        bool negative = false;
+        if constexpr (std::is_signed_v<T>) negative = current < 0;
+        switch (op) {
+            case MathOP::ADD:
+                if (__builtin_add_overflow(current, operand, &current)) current = operand < 0 ? lowest : highest;
+                break;
+            case MathOP::SUB:
+                if (__builtin_sub_overflow(current, operand, &current)) current = operand > 0 ? lowest : highest;
+                break;
+            case MathOP::MUL:
+                if (__builtin_mul_overflow(current, operand, &current)) current = negative != (operand < 0) ? lowest : highest;
+                break;
+            case MathOP::DIV:
+            case MathOP::MOD: {
+                if (operand == 0) return false;
+                if constexpr (std::is_signed_v<T>) {
+                    int64_t wide = current;
+                    // The one quotient out of int64_t, and a remainder the hardware may trap on
+                    if (operand == -1) {
+                        current = op == MathOP::MOD ? 0 : wide == INT64_MIN ? highest : saturate<T>(-wide);
+                    } else {
+                        current = saturate<T>(op == MathOP::MOD ? wide % operand : wide / operand);
+                    }
+                } else {
+                    uint64_t magnitude = operand < 0 ? 0 - static_cast<uint64_t>(operand) : static_cast<uint64_t>(operand);
+                    // A negative divisor gives a quotient below 0, the remainder keeps the sign of current
+                    if (op == MathOP::MOD) current = static_cast<T>(current % magnitude);
+                    else current = operand < 0 ? 0 : static_cast<T>(current / magnitude);
+                }
+                break;
+            }
+            case MathOP::POW: current = math_integer_pow(current, operand); break;
+            case MathOP::SET: current = saturate<T>(operand); break;
+            case MathOP::EMPTY: break;
+            default: return false;
         }
+        return true;
     }
 
-    T result = 0;
-    while (true) {
-        char c = buf[position];
-        int digit = -1;
-        if (std::isdigit(c)) {
-            digit = c - '0';
-        } else if (base == 16 && std::isalpha(c)) {
-            digit = std::tolower(c) - 'a' + 10;
+    template<typename T>
+    bool applyAs(MathOP op, const MathOperand &operand) {
+        if constexpr (std::is_same_v<T, bool>) {
+            // Computed as an integer, any non zero result is true
+            int64_t current = load<bool>() ? 1 : 0;
+            if (!operand.integral) {
+                double real = static_cast<double>(current);
+                if (!compute(real, op, operand.real)) return false;
+                store<bool>(real != 0);
+                return true;
+            }
+            if (!computeInteger(current, op, operand.integer)) return false;
+            store<bool>(current != 0);
+            return true;
+        } else if constexpr (std::is_integral_v<T>) {
+            T current = load<T>();
+            // Fractions and negative powers can't be expressed in T, those take the double path
+            bool native = operand.integral && !(op == MathOP::POW && operand.integer < 0);
+            if (!native) {
+                double real = static_cast<double>(current);
+                if (!compute(real, op, operand.as<double>()) || !narrow(real, current)) return false;
+                store<T>(current);
+                return true;
+            }
+            if (!computeInteger(current, op, operand.integer)) return false;
+            store<T>(current);
+            return true;
+        } else {
+            T current = load<T>();
+            if (!compute(current, op, operand.as<T>())) return false;
+            store<T>(current);
+            return true;
         }
+    }
+};
+
+// Template to convert strings to integers with error handling
+// Supports both signed and unsigned integers, kept for existing callers, see parse_integer for bounded input
+template<typename T>
+size_t strToInt(const char *buf, T *value, T min_value, T max_value) {
+    const char *end = parse_integer(buf, buf + strlen(buf), *value, min_value, max_value);
+    return end - buf;
+}
+
+inline std::string longestCommonPrefix(const std::vector<std::string> &strs) {
+    if (strs.empty()) return "";
+
+    // Start by assuming the whole first string is the prefix
+    std::string prefix = strs[0];
 
-        if (digit < 0 || digit >= base) break;
-        if (result > (max_value - digit) / base) return 0;
+    for (size_t i = 1; i < strs.size(); ++i) {
+        // Compare prefix with each string
+        size_t j = 0;
+        while (j < prefix.size() && j < strs[i].size() && prefix[j] == strs[i][j]) {
+            ++j;
+        }
+        prefix = prefix.substr(0, j);
 
-        result = result * base + digit;
-        position++;
+        if (prefix.empty()) break; // early exit if no common prefix
     }
 
-    if (isNegative) result = -result;
-    if (result < min_value || result > max_value) return 0;
+    return prefix;
+}
+
+template<typename T>
+struct is_optional_argument : std::false_type {};
+
+template<typename T>
+struct is_optional_argument<std::optional<T>> : std::true_type {};
+
+// argTypes character matching a C++ argument type, used to describe typed commands like string based ones
+template<typename T>
+constexpr char argument_type_code() {
+    if constexpr (is_optional_argument<T>::value) return argument_type_code<typename T::value_type>();
+    else if constexpr (std::is_floating_point_v<T>) return 'd';
+    else if constexpr (std::is_integral_v<T> && std::is_signed_v<T>) return 'i';
+    else if constexpr (std::is_integral_v<T>) return 'u';
+    else return 's';
+}
 
-    *value = result;
-    return position;
+template<typename... Args>
+constexpr bool optional_arguments_are_trailing() {
+    bool seenOptional = false;
+    bool trailing = true;
+    ((is_optional_argument<Args>::value ? (seenOptional = true) : (trailing = trailing && !seenOptional)), ...);
+    return trailing;
 }
 
 class  CommandParser {
 public:
-    struct Argument {
-        std::variant<double, uint64_t, int64_t, std::string> value;
+    // String holds the string alternative: std::string owns a copy, std::string_view points into the input line
+    template<typename String>
+    struct BasicArgument {
+        std::variant<double, uint64_t, int64_t, String> value;
         bool present = true;
 
-        Argument() {
+        BasicArgument() {
             present = false;
         };
 
@@ -168,13 +750,22 @@ public:
             return asInt64();
         }
 
-        Argument(double d) : value(d) {}
+        BasicArgument(double d) : value(d) {}
 
-        Argument(uint64_t u) : value(u) {}
+        BasicArgument(uint64_t u) : value(u) {}
 
-        Argument(int64_t i) : value(i) {}
+        BasicArgument(int64_t i) : value(i) {}
 
-        Argument(const std::string &s) : value(s) {}
+        BasicArgument(const String &s) : value(s) {}
+
+        template<typename Other>
+        explicit BasicArgument(const BasicArgument<Other> &other) : present(other.present) {
+            std::visit([this](const auto &v) {
+                using V = std::decay_t<decltype(v)>;
+                if constexpr (std::is_same_v<V, Other>) value = String(v);
+                else value = v;
+            }, other.value);
+        }
 
         double asDouble() const { return std::get<double>(value); }
 
@@ -182,7 +773,7 @@ public:
 
         int64_t asInt64() const { return std::get<int64_t>(value); }
 
-        const std::string &asString() const { return std::get<std::string>(value); }
+        const String &asString() const { return std::get<String>(value); }
 
         double asDoubleOr(double d) const {
             return present ? std::get<double>(value) : d;
@@ -196,505 +787,2749 @@ public:
             return present ? std::get<int64_t>(value) : i;
         }
 
-        const std::string &asStringOr(const std::string &s) const {
-            return present ? std::get<std::string>(value) : s;
+        const String &asStringOr(const String &s) const {
+            return present ? std::get<String>(value) : s;
         }
 
     };
 
+    using Argument = BasicArgument<std::string>;
+    using ArgumentView = BasicArgument<std::string_view>;
+
+    // Non-owning view over the arguments of the command being dispatched, only valid during the callback
+    struct ArgumentSpan {
+        const ArgumentView *first = nullptr;
+        size_t count = 0;
+
+        const ArgumentView *begin() const { return first; }
+
+        const ArgumentView *end() const { return first + count; }
+
+        size_t size() const { return count; }
+
+        bool empty() const { return count == 0; }
+
+        const ArgumentView &operator[](size_t i) const { return first[i]; }
+    };
+
+    using CommandCallback = std::function<std::string(const std::vector<Argument>&, Stream& stream)>;
+    using CommandViewCallback = std::function<std::string(ArgumentSpan, Stream& stream)>;
+    // Writes its response in place instead of returning a string, the allocation free form
+    using CommandWriteCallback = std::function<void(ArgumentSpan, Stream& stream, ResponseBuffer& response)>;
+
+    // Names one running asynchronous command. A token outlives its command safely: once the result is delivered the
+    // slot gets a new generation and finish_async with the old token is ignored.
+    struct AsyncToken {
+        uint8_t slot = 0xFF;
+        uint8_t generation = 0;
+
+        explicit operator bool() const { return slot != 0xFF; }
+
+        // Packed in 16 bits, to travel through a queue
+        uint16_t value() const { return static_cast<uint16_t>(slot | (generation << 8)); }
+
+        static AsyncToken from(uint16_t value) { return AsyncToken{static_cast<uint8_t>(value & 0xFF), static_cast<uint8_t>(value >> 8)}; }
+    };
+
+    // Starts the work and returns at once, keeping the token to call finish_async when done (from loop(), a timer...).
+    // Arguments are views into the input line, copy what is needed past the call.
+    using CommandAsyncCallback = std::function<void(ArgumentSpan, Stream& stream, AsyncToken token)>;
+
+    // Writes the next part of a streaming response, returns true once it wrote the last one. Keeps its own position
+    // (captured state), a piece refused by the writer has to be written again on the next call.
+    using CommandGenerator = std::function<bool(ResponseWriter& out)>;
+    // Returns the generator of the response, or an empty one when there is nothing to write
+    using CommandStreamCallback = std::function<CommandGenerator(ArgumentSpan, Stream& stream)>;
+
+    // A result taken from the pending queue, with the id of the command that produced it
+    struct AsyncResult {
+        uint16_t id;
+        bool ok;
+    };
+
+    // Where processCommand runs its lines, see CommandExecutor.h. Without one (the default) they run inline, in the
+    // caller. The line travels with a pending token: the executing side calls run_submitted, and the result reaches
+    // the handler that typed the line like an asynchronous one.
+    class Executor {
+    public:
+        virtual ~Executor() = default;
+
+        // Takes a copy of line, false when there is no room for it. priority is the command's (see set_priority).
+        virtual bool submit(std::string_view line, AsyncToken token, uint8_t priority) = 0;
+
+        // Longest line submit takes, longer ones and batches stay in the parser and an empty line carries their token
+        virtual size_t max_line_size() const { return static_cast<size_t>(-1); }
+    };
+
     struct BaseCommand {
         std::string name;
         std::string description;
+        // Assigned at registration, addresses the command in the binary protocol
+        uint16_t id = 0;
+        // Handed to the executor with every line of this command
+        uint8_t priority = 0;
+#ifdef COMMAND_PARSER_PROFILING
+        // Counters, updated through const references too
+        mutable CommandStats stats;
+#endif
         BaseCommand(const std::string &name, const std::string& description) : name(name), description(description) {}
     };
 
+    // Parses the arguments and calls the callback of a typed command, generated by registerCommand<Args...>
+    using TypedInvoker = std::function<bool(std::string_view args, std::string &response, Stream& stream)>;
+
+    // argTypes compiled once at registration: one parser per argument, every slot from required on is optional
+    struct ArgumentPlan {
+        using SlotParser = bool (*)(std::string_view &cursor, ArgumentView &arg);
+
+        struct Slot {
+            SlotParser parse;
+            char type;
+        };
+
+        std::vector<Slot> slots;
+        size_t required = 0;
+    };
+
+    // Exactly one of callback / viewCallback / writeCallback / asyncCallback / streamCallback is set, typed commands additionally have invoker as their text fast path
     struct  Command : public BaseCommand {
         std::string argTypes;
-        std::function<std::string(std::vector<Argument>, Stream& stream)> callback;
+        ArgumentPlan plan;
+        CommandCallback callback;
+        CommandViewCallback viewCallback;
+        CommandWriteCallback writeCallback;
+        CommandAsyncCallback asyncCallback;
+        CommandStreamCallback streamCallback;
+        TypedInvoker invoker;
 
         Command(const std::string &name, const std::string &argTypes,
-                std::function<std::string(std::vector<Argument>, Stream& stream)> callback, const std::string& description = "")
+                CommandCallback callback, const std::string& description = "")
                 : BaseCommand(name, description), argTypes(argTypes), callback(callback) {}
+
+        Command(const std::string &name, const std::string &argTypes,
+                CommandViewCallback viewCallback, const std::string& description = "")
+                : BaseCommand(name, description), argTypes(argTypes), viewCallback(viewCallback) {}
+
+        Command(const std::string &name, const std::string &argTypes,
+                TypedInvoker invoker, const std::string& description = "")
+                : BaseCommand(name, description), argTypes(argTypes), invoker(invoker) {}
+
+        Command(const std::string &name, const std::string &argTypes,
+                CommandWriteCallback writeCallback, const std::string& description = "")
+                : BaseCommand(name, description), argTypes(argTypes), writeCallback(writeCallback) {}
+
+        Command(const std::string &name, const std::string &argTypes,
+                CommandAsyncCallback asyncCallback, const std::string& description = "")
+                : BaseCommand(name, description), argTypes(argTypes), asyncCallback(asyncCallback) {}
+
+        Command(const std::string &name, const std::string &argTypes,
+                CommandStreamCallback streamCallback, const std::string& description = "")
+                : BaseCommand(name, description), argTypes(argTypes), streamCallback(streamCallback) {}
     };
 
 
+    // Command known at compile time, for static constexpr tables that are read in place: on ARM and ESP targets they
+    // stay in flash and registering one costs no allocation per command. name has to be lowercase.
+    struct StaticCommand {
+        const char *name;
+        const char *argTypes;
+        std::string (*callback)(ArgumentSpan args, Stream& stream);
+        const char *description;
+    };
+
     struct MathCommand : public BaseCommand {
-        std::shared_ptr<DoubleRef> value;
+        MathValue value;
         std::function<std::string( Stream& stream, double value, MathOP op)> callback;
         template<typename T>
         MathCommand(const std::string &name, T& value,
                 std::function<std::string( Stream& stream, double value, MathOP op)> callback, const std::string& description)
-                    :BaseCommand(name, description), value(std::make_shared<DoubleRefImpl<T>>(value)),   callback(callback){}
+                    :BaseCommand(name, description), value(value),   callback(callback){}
     };
 
 private:
-    std::vector<Argument> commandArgs;
-    std::vector<Command> commandDefinitions;
-    std::vector<MathCommand> mathCommandDefinition;
+    // Position of a name in commandDefinitions / mathCommandDefinition / groups, npos when the name has no entry of that kind
+    struct CommandIndex {
+        static constexpr size_t npos = static_cast<size_t>(-1);
+        size_t command = npos;
+        size_t math = npos;
+        size_t group = npos;
+    };
 
-    size_t parseString(const char *buf, std::string &output) {
-        size_t readCount = 0;
-        bool isQuoted = (buf[0] == '"');
+    // A nested namespace with its own tables, one token of the line per level
+    struct CommandGroup {
+        std::string name;
+        std::string description;
+        std::unique_ptr<CommandParser> parser;
+    };
 
-        if (isQuoted) readCount++;
+    // Groups are built without the root's built-in commands, the root's stats already cover them, and share the
+    // root's state (see RootState)
+    struct GroupLevel {};
 
-        while (buf[readCount] != '\0') {
-            char c = buf[readCount++];
-            if (isQuoted && c == '"') break;
-            if (!isQuoted && std::isspace(c)) break;
-            output.push_back(c);
-        }
+    CommandParser(GroupLevel, CommandParser &owner) : parent(&owner), rootState(), core(owner.core) {}
 
-        return readCount;
-    }
+    // Operator and operands of a math line, parsed apart from running it so a macro step keeps its own
+    struct MathRequest {
+        MathOP op = MathOP::EMPTY;
+        MathOperand operand;
+        double operands[MAX_MATH_OPERANDS] = {};
+    };
 
-public:
-    bool registerCommand(const std::string &name, const std::string &argTypes,
-                         std::function<std::string(std::vector<Argument>, Stream& stream)> callback, std::string description = "") {
-        for (char type: argTypes) {
-            if (type != 'd' && type != 'u' && type != 'i' && type != 's' && type!= 'o') return false;
+    struct Macro;
+
+    // One ';' separated step of a macro, its target is looked up and its arguments parsed when the macro is defined
+    struct MacroStep {
+        enum Kind : uint8_t {
+            COMMAND,
+            MATH,
+            MACRO,
+            // Groups and static commands go through runLine with the whole step
+            LINE
+        };
+        Kind kind = LINE;
+        size_t index = CommandIndex::npos;
+        Macro *macro = nullptr;
+        // The step's arguments, the whole step for LINE
+        std::string text;
+        // text holds $ parameters, it is substituted and parsed on every run
+        bool substituted = false;
+        // Views into text, the steps vector doesn't change once they are parsed
+        std::vector<ArgumentView> args;
+        MathRequest math;
+    };
+
+    struct Macro {
+        std::string name;
+        std::string body;
+        std::vector<MacroStep> steps;
+        // registryVersion the steps were resolved against, removals shift the positions they hold
+        uint32_t version = 0;
+        bool running = false;
+        // Per macro so one can run another
+        std::string line;
+        std::string stepResponse;
+    };
+
+    std::vector<Command> commandDefinitions;
+    std::vector<MathCommand> mathCommandDefinition;
+    std::vector<CommandGroup> groups;
+    std::vector<std::unique_ptr<Macro>> macros;
+    uint32_t registryVersion = 0;
+    // The level this one is a group of, null for the root
+    CommandParser *parent = nullptr;
+    std::unordered_map<std::string, CommandIndex> commandIndex;
+    std::unordered_map<uint16_t, CommandIndex> idIndex;
+    uint16_t nextCommandId = 1;
+    CommandTrie completionTrie;
+
+    // What a static command can't hold in its flash table: its plan, compiled at registration, and its counters
+    struct StaticEntry {
+        ArgumentPlan plan;
+#ifdef COMMAND_PARSER_PROFILING
+        mutable CommandStats stats;
+#endif
+    };
+
+    // A registered StaticCommand array, its commands get the ids firstId to firstId + count - 1
+    struct StaticTable {
+        const StaticCommand *commands;
+        size_t count;
+        uint16_t firstId;
+        bool sorted;
+        std::vector<StaticEntry> entries;
+    };
+    std::vector<StaticTable> staticTables;
+
+    // An asynchronous command between its start and the handler of its stream taking the result
+    // With an executor, the handler core starts and takes results while the other one finishes them, so state is the
+    // only field both sides touch before it says the slot is theirs.
+    struct PendingCommand {
+        enum State : uint8_t {
+            FREE,
+            RUNNING,
+            DONE
+        };
+        std::atomic<uint8_t> state{FREE};
+        uint8_t generation = 0;
+        bool ok = true;
+        // Finishing order, results are taken oldest first
+        uint32_t order = 0;
+        uint16_t id = 0;
+        // A submitted block of lines, run as processBatch runs it
+        bool batch = false;
+        // The submitted text is in text, not in the executor's queue
+        bool stored = false;
+        const Stream *stream = nullptr;
+        std::string response;
+        std::string text;
+    };
+
+    // A math variable sent to one stream on a schedule, see watch(). Only the handler side and watch() touch them.
+    struct Watch {
+        const Stream *stream = nullptr;
+        // Level holding the variable, id and index are its own
+        CommandParser *owner = nullptr;
+        std::string name;
+        uint16_t id = 0;
+        size_t index = 0;
+        // registryVersion index was looked up in
+        uint32_t version = 0;
+        uint32_t periodMicros = 0;
+        uint32_t last = 0;
+        bool onlyChanged = false;
+        bool sent = false;
+        // Bytes last sent, for onlyChanged
+        alignas(8) uint8_t value[8] = {};
+    };
+
+    // A registration waits for the line in progress on the other core and holds back the next one until it is done.
+    // Only used with an executor, a callback registering commands there would wait for itself.
+    struct RegistryGuard {
+        std::atomic<uint8_t> readers{0};
+        std::atomic<bool> writing{false};
+    };
+
+    struct ReadLock {
+        RegistryGuard *guard;
+
+        explicit ReadLock(RegistryGuard *guard) : guard(guard) {
+            if (guard == nullptr) return;
+            while (true) {
+                while (guard->writing.load()) {}
+                guard->readers.fetch_add(1);
+                if (!guard->writing.load()) return;
+                guard->readers.fetch_sub(1);
+            }
+        }
+
+        ~ReadLock() {
+            if (guard != nullptr) guard->readers.fetch_sub(1);
+        }
+    };
+
+    struct WriteLock {
+        RegistryGuard *guard;
+
+        explicit WriteLock(RegistryGuard *guard) : guard(guard) {
+            if (guard == nullptr) return;
+            bool expected = false;
+            while (!guard->writing.compare_exchange_weak(expected, true)) expected = false;
+            while (guard->readers.load() != 0) {}
+        }
+
+        ~WriteLock() {
+            if (guard != nullptr) guard->writing.store(false);
         }
+    };
+
+    // What only the root owns: asynchronous results, watches, the executor, the registry guard and the buffers a line is
+    // parsed into. A group level points to its root's and only holds its own commands, variables and groups.
+    struct RootState {
+        // Sized for the longest signature at registration, so dispatching never grows them
+        std::vector<Argument> commandArgs;
+        std::vector<ArgumentView> commandArgViews;
+        std::string lookupName;
+        std::string operatorName;
+        // Custom operators apply to the variables of every level
+        std::vector<MathOperator> mathOperators;
+        std::unordered_map<std::string, size_t> mathOperatorIndex;
+        // complete() runs on the handler core while an executor may be running a line
+        std::string completionLookup;
+        std::string completionName;
+        std::string completionPath;
+        std::string completionDescription;
+        std::array<PendingCommand, COMMAND_PARSER_MAX_PENDING> pending;
+        std::atomic<uint32_t> finishedCount{0};
+        // Where a streaming command hands its generator, null when the caller wants the response written at once
+        CommandGenerator *generatorOut = nullptr;
+        Executor *executor = nullptr;
+        // Stream whose handler gets the results of asynchronous commands started by an executed line
+        const Stream *asyncOrigin = nullptr;
+        std::string submitName;
+        // Line submitted for a binary request or the error of a refused batch, only used on the handler side
+        std::string submitText;
+        std::vector<std::string_view> batchLines;
+        std::string batchResponse;
+        std::array<Watch, COMMAND_PARSER_MAX_WATCHES> watches;
+        RegistryGuard registryGuard;
+#ifdef COMMAND_PARSER_PROFILING
+        ParserStats parserStats;
+        CommandStats *profiled = nullptr;
+        unsigned long profileStart = 0;
+        unsigned long callbackStart = 0;
+#endif
+    };
+    // Null for a group level
+    std::unique_ptr<RootState> rootState{new RootState()};
+    RootState *core = rootState.get();
+
+    RegistryGuard *activeGuard() {
+        return core->executor != nullptr ? &core->registryGuard : nullptr;
+    }
+
+    // Lines reach the executor through the root, running one on a group level directly stays inline
+    [[nodiscard]] Executor *lineExecutor() const {
+        return parent == nullptr ? core->executor : nullptr;
+    }
+
+    // The first registration of a name wins, like the linear lookup it replaces
+    void indexCommand(const std::string &name, size_t position) {
+        auto &entry = commandIndex[name];
+        if (entry.command == CommandIndex::npos) entry.command = position;
+    }
+
+    void indexMathCommand(const std::string &name, size_t position) {
+        auto &entry = commandIndex[name];
+        if (entry.math == CommandIndex::npos) entry.math = position;
+    }
+
+    // Removing shifts the vectors, so positions are recomputed from scratch
+    void rebuildIndex() {
+        registryVersion++;
+        commandIndex.clear();
+        idIndex.clear();
+        for (size_t i = 0; i < commandDefinitions.size(); ++i) {
+            indexCommand(commandDefinitions[i].name, i);
+            idIndex[commandDefinitions[i].id].command = i;
+        }
+        for (size_t i = 0; i < mathCommandDefinition.size(); ++i) {
+            indexMathCommand(mathCommandDefinition[i].name, i);
+            idIndex[mathCommandDefinition[i].id].math = i;
+        }
+        for (size_t i = 0; i < groups.size(); ++i) {
+            commandIndex[groups[i].name].group = i;
+        }
+    }
+
+    // A line naming a group always enters it, a command of the same name could never be reached
+    bool hasGroup(const std::string &name) const {
+        auto found = commandIndex.find(name);
+        return found != commandIndex.end() && found->second.group != CommandIndex::npos;
+    }
+
+    template<typename Callback>
+    bool addCommand(const std::string &name, const std::string &argTypes, Callback &callback, const std::string &description) {
+        ArgumentPlan plan;
+        if (!compilePlan(argTypes, plan)) return false;
         std::string new_name;
         for (auto &c: name) {
             new_name += tolower(c);
         }
-        commandDefinitions.emplace_back(new_name, argTypes, callback, description);
+        if (hasGroup(new_name)) return false;
+        commandDefinitions.emplace_back(new_name, argTypes, std::move(callback), description);
+        // Sized for the longest signature now, so dispatching never grows them
+        core->commandArgViews.reserve(std::max(core->commandArgViews.capacity(), plan.slots.size()));
+        core->commandArgs.reserve(std::max(core->commandArgs.capacity(), plan.slots.size()));
+        commandDefinitions.back().plan = std::move(plan);
+        commandDefinitions.back().id = nextCommandId++;
+        indexCommand(commandDefinitions.back().name, commandDefinitions.size() - 1);
+        idIndex[commandDefinitions.back().id].command = commandDefinitions.size() - 1;
+        completionTrie.insert(new_name, CommandTrie::COMMAND);
+        return true;
+    }
+
+    static bool parseDoubleSlot(std::string_view &cursor, ArgumentView &arg) {
+        double value;
+        if (!parseDouble(cursor, value)) return false;
+        arg = ArgumentView(value);
+        return true;
+    }
+
+    template<typename T>
+    static bool parseIntegerSlot(std::string_view &cursor, ArgumentView &arg) {
+        T value;
+        if (!parseInteger(cursor, value)) return false;
+        arg = ArgumentView(value);
+        return true;
+    }
+
+    static bool parseStringSlot(std::string_view &cursor, ArgumentView &arg) {
+        std::string_view value;
+        if (!parseString(cursor, value)) return false;
+        arg = ArgumentView(value);
+        return true;
+    }
+
+    // Every type after the 'o' marker is optional, so a second 'o' or one with nothing after it is refused
+    static bool compilePlan(std::string_view argTypes, ArgumentPlan &plan) {
+        plan.slots.clear();
+        bool optional = false;
+        for (char type: argTypes) {
+            switch (type) {
+                case 'd': plan.slots.push_back({&parseDoubleSlot, type}); break;
+                case 'u': plan.slots.push_back({&parseIntegerSlot<uint64_t>, type}); break;
+                case 'i': plan.slots.push_back({&parseIntegerSlot<int64_t>, type}); break;
+                case 's': plan.slots.push_back({&parseStringSlot, type}); break;
+                case 'o':
+                    if (optional) return false;
+                    optional = true;
+                    plan.required = plan.slots.size();
+                    break;
+                default: return false;
+            }
+        }
+        if (!optional) plan.required = plan.slots.size();
+        return !optional || plan.required < plan.slots.size();
+    }
+
+    // Only reached once the hash index missed, so names registered at runtime shadow the static ones
+    const StaticCommand *findStaticCommand(std::string_view name) const {
+        for (auto &table : staticTables) {
+            const StaticCommand *end = table.commands + table.count;
+            if (table.sorted) {
+                auto found = std::lower_bound(table.commands, end, name, [](const StaticCommand &command, std::string_view key) {
+                    return std::string_view(command.name) < key;
+                });
+                if (found != end && name == found->name) return found;
+            } else {
+                for (auto command = table.commands; command != end; ++command) {
+                    if (name == command->name) return command;
+                }
+            }
+        }
+        return nullptr;
+    }
+
+    // Plan and counters of a command of a registered table
+    const StaticEntry &staticEntry(const StaticCommand *command) const {
+        std::less<const StaticCommand *> before;
+        for (auto &table : staticTables) {
+            if (!before(command, table.commands) && before(command, table.commands + table.count)) return table.entries[command - table.commands];
+        }
+        return staticTables.front().entries.front();
+    }
+
+    // "motor kd 5": enters the groups like runLine and returns the variable with the level holding it, name keeps what
+    // follows it. path gets the lowered names, single spaced.
+    MathCommand *findWatched(std::string_view &name, CommandParser *&owner, std::string &path) {
+        owner = this;
+        path.clear();
+        skipWhitespace(name);
+        while (true) {
+            size_t start = path.size();
+            std::string_view token = nextToken(name);
+            skipWhitespace(name);
+            path.append(token.data(), token.size());
+            for (size_t i = start; i < path.size(); ++i) {
+                path[i] = tolower(path[i]);
+            }
+            auto found = owner->commandIndex.find(path.substr(start));
+            if (found == owner->commandIndex.end()) return nullptr;
+            if (found->second.group != CommandIndex::npos && !name.empty()) {
+                owner = owner->groups[found->second.group].parser.get();
+                path += ' ';
+                continue;
+            }
+            if (found->second.math == CommandIndex::npos) return nullptr;
+            return &owner->mathCommandDefinition[found->second.math];
+        }
+    }
+
+    Watch *findWatch(const Stream &stream, const CommandParser *owner, uint16_t id) {
+        for (auto &watch : core->watches) {
+            if (watch.stream == &stream && watch.owner == owner && watch.id == id) return &watch;
+        }
+        return nullptr;
+    }
+
+    // The root's watches into a group about to be removed would keep its parser
+    void dropWatchesIn(const CommandParser &removed) {
+        for (auto &watch : core->watches) {
+            for (auto *level = watch.owner; watch.stream != nullptr && level != nullptr; level = level->parent) {
+                if (level == &removed) watch.stream = nullptr;
+            }
+        }
+    }
+
+    bool runWatchCommand(Stream &stream, std::string_view name, bool hasPeriod, uint64_t period, std::string_view flag,
+                         std::string &response) {
+        response.clear();
+        if (name.empty()) {
+            char line[64];
+            for_each_watch(stream, [&](const MathCommand &, std::string_view path, uint32_t periodMs, bool onlyChanged) {
+                snprintf(line, sizeof(line), " %lu%s", static_cast<unsigned long>(periodMs), onlyChanged ? PSTR(" changed") : "");
+                if (!response.empty()) response += PSTR("\r\n");
+                response.append(path.data(), path.size()).append(line);
+            });
+            return true;
+        }
+        bool onlyChanged = flag == "changed";
+        if (!hasPeriod) response = commandErrorMessage(ERROR_INVALID_UNSIGNED);
+        else if (!flag.empty() && !onlyChanged) response = commandErrorMessage(ERROR_INVALID_STRING);
+        else if (period == 0 && !unwatch(stream, name)) response = commandErrorMessage(ERROR_UNKNOWN_COMMAND);
+        else if (period != 0 && !watch(stream, name, static_cast<uint32_t>(std::min<uint64_t>(period, UINT32_MAX)), onlyChanged)) {
+            CommandParser *owner;
+            std::string path;
+            std::string_view rest = name;
+            bool known = findWatched(rest, owner, path) != nullptr && rest.empty();
+            response = commandErrorMessage(known ? ERROR_TOO_MANY_WATCHES : ERROR_UNKNOWN_COMMAND);
+        }
+        return response.empty();
+    }
+
+    MathCommand *findMathCommand(const std::string &name) {
+        auto found = commandIndex.find(name);
+        if (found == commandIndex.end() || found->second.math == CommandIndex::npos) return nullptr;
+        return &mathCommandDefinition[found->second.math];
+    }
+
+
+    static void skipWhitespace(std::string_view &cursor) {
+        auto pos = cursor.find_first_not_of(" \n\r\t");
+        cursor.remove_prefix(pos == std::string_view::npos ? cursor.size() : pos);
+    }
+
+    static void trimBack(std::string_view &cursor) {
+        auto pos = cursor.find_last_not_of(" \n\r\t");
+        cursor.remove_suffix(pos == std::string_view::npos ? cursor.size() : cursor.size() - pos - 1);
+    }
+
+    // Returns everything up to the next whitespace and moves the cursor past it
+    static std::string_view nextToken(std::string_view &cursor) {
+        auto end = cursor.find_first_of(" \n\r\t");
+        std::string_view token = cursor.substr(0, end);
+        cursor.remove_prefix(token.size());
+        return token;
+    }
+
+    // Both parsers stop at the end of the cursor, the line doesn't need to be null terminated
+    template<typename T>
+    static bool parseFloat(std::string_view &cursor, T &value) {
+        const char *end = parse_float(cursor.data(), cursor.data() + cursor.size(), value);
+        if (end == cursor.data()) return false;
+        cursor.remove_prefix(end - cursor.data());
+        return true;
+    }
+
+    static bool parseDouble(std::string_view &cursor, double &value) {
+        return parseFloat(cursor, value);
+    }
+
+    template<typename T>
+    static bool parseInteger(std::string_view &cursor, T &value) {
+        const char *end = parse_integer(cursor.data(), cursor.data() + cursor.size(), value);
+        if (end == cursor.data()) return false;
+        cursor.remove_prefix(end - cursor.data());
+        return true;
+    }
+
+    // The output points into the cursor's buffer, surrounding quotes excluded
+    static bool parseString(std::string_view &cursor, std::string_view &output) {
+        if (cursor.empty()) return false;
+        size_t readCount = 0;
+        bool isQuoted = (cursor[0] == '"');
+
+        if (isQuoted) readCount++;
+
+        size_t start = readCount;
+        size_t length = 0;
+        while (readCount < cursor.size()) {
+            char c = cursor[readCount++];
+            if (isQuoted && c == '"') break;
+            if (!isQuoted && std::isspace(c)) break;
+            length++;
+        }
+
+        output = cursor.substr(start, length);
+        cursor.remove_prefix(readCount);
+        return true;
+    }
+
+    static const char *argumentError(char argType) {
+        switch (argType) {
+            case 'd': return commandErrorMessage(ERROR_INVALID_DOUBLE);
+            case 'u': return commandErrorMessage(ERROR_INVALID_UNSIGNED);
+            case 'i': return commandErrorMessage(ERROR_INVALID_INTEGER);
+            default: return commandErrorMessage(ERROR_INVALID_STRING);
+        }
+    }
+
+    template<typename T>
+    static bool parseTyped(std::string_view &cursor, T &value) {
+        static_assert(!std::is_same_v<T, bool>, "bool arguments are not supported, use an integer");
+        if constexpr (std::is_same_v<T, float> || std::is_same_v<T, double>) {
+            return parseFloat(cursor, value);
+        } else if constexpr (std::is_floating_point_v<T>) {
+            double d;
+            if (!parseDouble(cursor, d)) return false;
+            value = static_cast<T>(d);
+            return true;
+        } else if constexpr (std::is_integral_v<T>) {
+            return parseInteger(cursor, value);
+        } else if constexpr (std::is_same_v<T, std::string_view>) {
+            return parseString(cursor, value);
+        } else {
+            static_assert(std::is_same_v<T, std::string>, "Unsupported argument type");
+            std::string_view view;
+            if (!parseString(cursor, view)) return false;
+            value.assign(view.data(), view.size());
+            return true;
+        }
+    }
+
+    // Once an optional argument is missing, every following one is left empty, like the 'o' marker
+    template<typename T>
+    static bool parseTypedSlot(std::string_view &cursor, T &value, bool &done, std::string &response) {
+        skipWhitespace(cursor);
+        if constexpr (is_optional_argument<T>::value) {
+            typename T::value_type inner;
+            if (!done && parseTyped(cursor, inner)) {
+                value = inner;
+            } else {
+                done = true;
+            }
+            return true;
+        } else {
+            if (parseTyped(cursor, value)) return true;
+            response = argumentError(argument_type_code<T>());
+            return false;
+        }
+    }
+
+    template<typename Tuple, size_t... I>
+    static bool parseTypedArguments(std::string_view &cursor, Tuple &values, std::string &response, std::index_sequence<I...>) {
+        [[maybe_unused]] bool done = false;
+        return (parseTypedSlot(cursor, std::get<I>(values), done, response) && ...);
+    }
+
+    template<typename T>
+    static T fromArgument(const ArgumentView &arg) {
+        if constexpr (is_optional_argument<T>::value) {
+            if (!arg) return std::nullopt;
+            return fromArgument<typename T::value_type>(arg);
+        } else if constexpr (std::is_floating_point_v<T>) {
+            return static_cast<T>(arg.asDouble());
+        } else if constexpr (std::is_integral_v<T> && std::is_signed_v<T>) {
+            return static_cast<T>(arg.asInt64());
+        } else if constexpr (std::is_integral_v<T>) {
+            return static_cast<T>(arg.asUInt64());
+        } else {
+            return T(arg.asString());
+        }
+    }
+
+    template<typename... Args, typename Callback, size_t... I>
+    static std::string callWithArguments(Callback &callback, Stream& stream, [[maybe_unused]] ArgumentSpan args, std::index_sequence<I...>) {
+        return callback(stream, fromArgument<std::decay_t<Args>>(args[I])...);
+    }
+
+    template<typename... Args>
+    static std::string typedArgTypes() {
+        std::string types;
+        bool optional = false;
+        // 'o' goes right before the first optional type
+        [[maybe_unused]] auto append = [&types, &optional](bool isOptional, char code) {
+            if (isOptional && !optional) {
+                optional = true;
+                types += 'o';
+            }
+            types += code;
+        };
+        (append(is_optional_argument<Args>::value, argument_type_code<Args>()), ...);
+        return types;
+    }
+
+public:
+    bool registerCommand(const std::string &name, const std::string &argTypes,
+                         CommandCallback callback, std::string description = "") {
+        WriteLock lock(activeGuard());
+        return addCommand(name, argTypes, callback, description);
+    }
+
+    // Same as above but the callback gets views into the input line, a dispatch then copies no argument
+    bool registerCommand(const std::string &name, const std::string &argTypes,
+                         CommandViewCallback callback, std::string description = "") {
+        WriteLock lock(activeGuard());
+        return addCommand(name, argTypes, callback, description);
+    }
+
+    // The callback writes into the caller's response buffer, bounded to MAX_RESPONSE_SIZE, nothing is allocated
+    bool registerCommand(const std::string &name, const std::string &argTypes,
+                         CommandWriteCallback callback, std::string description = "") {
+        WriteLock lock(activeGuard());
+        return addCommand(name, argTypes, callback, description);
+    }
+
+    // For long operations (motor moves, flash writes): the line completes with an empty response as soon as the
+    // callback returns and the handler of the stream prints the result once finish_async is called
+    bool registerCommand(const std::string &name, const std::string &argTypes,
+                         CommandAsyncCallback callback, std::string description = "") {
+        WriteLock lock(activeGuard());
+        reservePending();
+        return addCommand(name, argTypes, callback, description);
+    }
+
+    // For large dumps: the generator writes the response over several turns, RESPONSE_CHUNK_SIZE bytes at most each,
+    // so it never exists in RAM as a whole. The line itself completes with an empty response.
+    bool registerCommand(const std::string &name, const std::string &argTypes,
+                         CommandStreamCallback callback, std::string description = "") {
+        WriteLock lock(activeGuard());
+        return addCommand(name, argTypes, callback, description);
+    }
+
+    // Completes a running asynchronous command, false when the token is stale or was already finished
+    bool finish_async(AsyncToken token, std::string_view response, bool ok = true) {
+        if (!token || token.slot >= core->pending.size()) return false;
+        auto &slot = core->pending[token.slot];
+        if (slot.state.load(std::memory_order_acquire) != PendingCommand::RUNNING || slot.generation != token.generation) return false;
+        // Kept whole, an executed line answers as much as it would inline. The reserve only covers the usual size.
+        slot.response.assign(response.data(), response.size());
+        slot.ok = ok;
+        slot.order = core->finishedCount.fetch_add(1, std::memory_order_relaxed);
+        slot.state.store(PendingCommand::DONE, std::memory_order_release);
+        return true;
+    }
+
+    // Gives up on a running asynchronous command, nothing is printed for it and its slot is free again
+    bool cancel_async(AsyncToken token) {
+        if (!token || token.slot >= core->pending.size()) return false;
+        auto &slot = core->pending[token.slot];
+        if (slot.state.load(std::memory_order_acquire) == PendingCommand::FREE || slot.generation != token.generation) return false;
+        release(slot);
+        return true;
+    }
+
+    // Lines, batches and binary requests are submitted instead of run while one is set
+    [[nodiscard]] bool has_executor() const {
+        return lineExecutor() != nullptr;
+    }
+
+    // Set before the other core starts running lines, nullptr goes back to running them inline. While one is set the
+    // registry can be changed from either core, but not from inside a callback.
+    void setExecutor(Executor *newExecutor) {
+        if (newExecutor != nullptr) reservePending();
+        core->executor = newExecutor;
+    }
+
+    // Executor side: runs a submitted line and completes its token. Callbacks get stream, which should belong to the
+    // executing core, the response is what reaches the terminal. Asynchronous commands it starts report there too.
+    bool run_submitted(std::string_view line, AsyncToken token, std::string &response, Stream& stream) {
+        if (!token || token.slot >= core->pending.size()) return false;
+        core->asyncOrigin = core->pending[token.slot].stream;
+        if (core->pending[token.slot].stored) line = core->pending[token.slot].text;
+        bool ok;
+        if (core->pending[token.slot].batch) {
+            response.clear();
+            ok = runBatch(line, response, stream) == 0;
+            if (response.size() >= 2) response.resize(response.size() - 2);
+        } else {
+            ok = processLine(line, response, stream);
+        }
+        core->asyncOrigin = nullptr;
+        finish_async(token, response, ok);
+        return ok;
+    }
+
+    // Lines of this command are handed to the executor with this priority, higher runs first with a PriorityExecutor
+    bool set_priority(std::string name, uint8_t priority) {
+        WriteLock lock(activeGuard());
+        for (auto &c : name) {
+            c = tolower(c);
+        }
+        auto found = commandIndex.find(name);
+        if (found == commandIndex.end()) return false;
+        if (found->second.command != CommandIndex::npos) commandDefinitions[found->second.command].priority = priority;
+        if (found->second.math != CommandIndex::npos) mathCommandDefinition[found->second.math].priority = priority;
+        return true;
+    }
+
+    // Moves the oldest finished result started from this stream into response and frees its slot
+    std::optional<AsyncResult> take_finished(const Stream& stream, std::string &response) {
+        PendingCommand *oldest = nullptr;
+        for (auto &slot : core->pending) {
+            if (slot.state.load(std::memory_order_acquire) != PendingCommand::DONE || slot.stream != &stream) continue;
+            if (oldest == nullptr || static_cast<int32_t>(slot.order - oldest->order) < 0) oldest = &slot;
+        }
+        if (oldest == nullptr) return std::nullopt;
+        response.assign(oldest->response);
+        AsyncResult result{oldest->id, oldest->ok};
+        release(*oldest);
+        return result;
+    }
+
+    // Asynchronous commands started and not taken yet
+    [[nodiscard]] size_t pending_count() const {
+        size_t count = 0;
+        for (auto &slot : core->pending) count += slot.state.load(std::memory_order_relaxed) != PendingCommand::FREE;
+        return count;
+    }
+
+    // Sends the math variable name to stream every periodMs from the stream's handler, one subscription instead of the
+    // host polling it. With onlyChanged a due value equal to the last one sent is skipped. Watching it again changes
+    // the period. "motor kd" watches kd of the group motor. A terminal prints the watches of its handler's own
+    // stream, see CommandLineHandler::watch. False for an unknown name, a period of 0 or once
+    // COMMAND_PARSER_MAX_WATCHES are in use.
+    bool watch(const Stream &stream, std::string_view name, uint32_t periodMs, bool onlyChanged = false) {
+        CommandParser *owner;
+        std::string path;
+        MathCommand *command = findWatched(name, owner, path);
+        if (command == nullptr || !name.empty() || periodMs == 0) return false;
+        Watch *slot = findWatch(stream, owner, command->id);
+        for (auto &watch : core->watches) {
+            if (slot == nullptr && watch.stream == nullptr) slot = &watch;
+        }
+        if (slot == nullptr) return false;
+        slot->stream = &stream;
+        slot->owner = owner;
+        slot->name = std::move(path);
+        slot->id = command->id;
+        slot->index = command - owner->mathCommandDefinition.data();
+        slot->version = owner->registryVersion;
+        slot->periodMicros = std::min<uint32_t>(periodMs, UINT32_MAX / 1000) * 1000;
+        slot->last = static_cast<uint32_t>(micros()) - slot->periodMicros;
+        slot->onlyChanged = onlyChanged;
+        slot->sent = false;
+        return true;
+    }
+
+    bool unwatch(const Stream &stream, std::string_view name) {
+        CommandParser *owner;
+        std::string path;
+        MathCommand *command = findWatched(name, owner, path);
+        if (command == nullptr || !name.empty()) return false;
+        Watch *slot = findWatch(stream, owner, command->id);
+        if (slot == nullptr) return false;
+        slot->stream = nullptr;
+        return true;
+    }
+
+    void unwatch_all(const Stream &stream) {
+        for (auto &watch : core->watches) {
+            if (watch.stream == &stream) watch.stream = nullptr;
+        }
+    }
+
+    // Calls visitor(const MathCommand&, std::string_view path, uint32_t periodMs, bool onlyChanged) for every watch of
+    // stream, path is the name with its groups as given to watch(), "motor kd"
+    template<typename Visitor>
+    void for_each_watch(const Stream &stream, Visitor &&visitor) const {
+        for (auto &watch : core->watches) {
+            if (watch.stream != &stream || watch.version != watch.owner->registryVersion) continue;
+            visitor(static_cast<const MathCommand &>(watch.owner->mathCommandDefinition[watch.index]),
+                    std::string_view(watch.name), watch.periodMicros / 1000, watch.onlyChanged);
+        }
+    }
+
+    // For the handler of stream: calls visitor(const MathCommand&, std::string_view path) for each of its watches due
+    // at now (micros) and returns how many, so the handler sends them together. Watches of a removed variable are
+    // dropped.
+    template<typename Visitor>
+    size_t poll_watches(const Stream &stream, uint32_t now, Visitor &&visitor) {
+        ReadLock lock(activeGuard());
+        size_t count = 0;
+        for (auto &watch : core->watches) {
+            if (watch.stream != &stream || now - watch.last < watch.periodMicros) continue;
+            // Whole periods keep the schedule, a handler called late restarts it from now
+            watch.last = now - watch.last < 2 * watch.periodMicros ? watch.last + watch.periodMicros : now;
+            CommandParser &owner = *watch.owner;
+            if (watch.version != owner.registryVersion) {
+                auto found = owner.idIndex.find(watch.id);
+                if (found == owner.idIndex.end() || found->second.math == CommandIndex::npos) {
+                    watch.stream = nullptr;
+                    continue;
+                }
+                watch.index = found->second.math;
+                watch.version = owner.registryVersion;
+            }
+            auto &command = owner.mathCommandDefinition[watch.index];
+            alignas(8) uint8_t value[8];
+            command.value.save(value);
+            if (watch.onlyChanged && watch.sent && memcmp(value, watch.value, command.value.size()) == 0) continue;
+            memcpy(watch.value, value, command.value.size());
+            watch.sent = true;
+            visitor(static_cast<const MathCommand &>(command), std::string_view(watch.name));
+            count++;
+        }
+        return count;
+    }
+
+    // "watch" lists the watches of the calling stream, "watch name period_ms [changed]" adds or changes one and a
+    // period of 0 removes it, name going through the groups like a line does. Lines run by an executor change the
+    // watches under the handler, call watch() there then.
+    bool register_watch_command(const std::string &name = COMMAND_PARSER_WATCH_COMMAND) {
+        WriteLock lock(activeGuard());
+        TypedInvoker invoker = [this](std::string_view args, std::string &response, Stream& stream) {
+            skipWhitespace(args);
+            trimBack(args);
+            std::string_view rest = args;
+            CommandParser *owner;
+            std::string path;
+            if (!args.empty() && findWatched(rest, owner, path) == nullptr) {
+                response = commandErrorMessage(ERROR_UNKNOWN_COMMAND);
+                return false;
+            }
+            std::string_view watched = args.substr(0, rest.data() - args.data());
+            uint64_t period = 0;
+            bool hasPeriod = !rest.empty();
+            if (hasPeriod && !parseInteger(rest, period)) {
+                response = commandErrorMessage(ERROR_INVALID_UNSIGNED);
+                return false;
+            }
+            skipWhitespace(rest);
+            std::string_view flag = nextToken(rest);
+            skipWhitespace(rest);
+            if (!rest.empty()) {
+                response = commandErrorMessage(ERROR_TOO_MANY_ARGUMENTS);
+                return false;
+            }
+            return runWatchCommand(stream, watched, hasPeriod, period, flag, response);
+        };
+        if (!addCommand(name, "osus", invoker, PSTR("Lists the watches, 'name period_ms [changed]' sends a variable on a schedule, period 0 stops it"))) return false;
+        // Called by id the arguments come parsed, a name inside a group is one string, "motor kd"
+        commandDefinitions.back().viewCallback = [this](ArgumentSpan args, Stream& stream) {
+            std::string response;
+            runWatchCommand(stream, args[0] ? args[0].asString() : std::string_view(), static_cast<bool>(args[1]),
+                            args[1] ? args[1].asUInt64() : 0, args[2] ? args[2].asString() : std::string_view(), response);
+            return response;
+        };
+        return true;
+    }
+    // registerCommand<double, uint64_t, std::optional<int64_t>>("name", [](Stream& stream, double a, uint64_t b, std::optional<int64_t> c) {...})
+    // The parser is generated for this exact signature and the callback gets the values directly, no Argument involved.
+    // Supported types are arithmetic types, std::string, std::string_view (pointing into the input line) and std::optional of those.
+    template<typename... Args, typename Callback>
+    std::enable_if_t<std::is_invocable_r_v<std::string, Callback&, Stream&, Args...>, bool>
+    registerCommand(const std::string &name, Callback callback, std::string description = "") {
+        static_assert(optional_arguments_are_trailing<Args...>(), "Required arguments can't follow an optional one");
+        WriteLock lock(activeGuard());
+        TypedInvoker invoker = [callback](std::string_view args, std::string &response, Stream& stream) mutable {
+            std::tuple<std::decay_t<Args>...> values;
+            if (!parseTypedArguments(args, values, response, std::index_sequence_for<Args...>{})) return false;
+            skipWhitespace(args);
+            if (!args.empty()) {
+                response = commandErrorMessage(ERROR_TOO_MANY_ARGUMENTS);
+                return false;
+            }
+            response = std::apply([&callback, &stream](auto &... value) { return callback(stream, value...); }, values);
+            return true;
+        };
+        if (!addCommand(name, typedArgTypes<Args...>(), invoker, description)) return false;
+        // Used when the arguments arrive already decoded, e.g. from the binary protocol
+        commandDefinitions.back().viewCallback = [callback](ArgumentSpan args, Stream& stream) mutable {
+            return callWithArguments<Args...>(callback, stream, args, std::index_sequence_for<Args...>{});
+        };
         return true;
     }
+
     template<typename T>
     bool registerMathCommand(std::string name, T& value, std::function<std::string(Stream& stream, double value, MathOP op)> callback, std::string description = "") {
+        WriteLock lock(activeGuard());
         for (auto &c : name) {
             c = tolower(c);
         }
+        if (hasGroup(name)) return false;
         mathCommandDefinition.emplace_back(name, value, callback, description);
+        mathCommandDefinition.back().id = nextCommandId++;
+        indexMathCommand(mathCommandDefinition.back().name, mathCommandDefinition.size() - 1);
+        idIndex[mathCommandDefinition.back().id].math = mathCommandDefinition.size() - 1;
+        completionTrie.insert(name, CommandTrie::MATH);
         return true;
     }
-    template<typename Container, typename T>
-    bool callRemoveOn(Container& c, T a) {
-        auto id = std::find_if(c.begin(), c.end(), a);
-        if (id != c.end()) {
-            c.erase(id);
+    // Adds an operator to every math command, it gets MathOP MathOPCount + 1 + its registration order.
+    // Names of the MATHOPS operators or of an already registered one are refused.
+    bool registerMathOperator(const MathOperator &op) {
+        WriteLock lock(activeGuard());
+        std::string name = op.name;
+        for (auto &c : name) {
+            c = tolower(c);
+        }
+        if (name.empty() || op.apply == nullptr || op.operands > MAX_MATH_OPERANDS) return false;
+        if (stringToMathOP(name) != MathOPCount || core->mathOperatorIndex.count(name) != 0) return false;
+        core->mathOperatorIndex[name] = core->mathOperators.size();
+        core->mathOperators.push_back(op);
+        return true;
+    }
+
+    // MATHOPS names come from the compile time table, registered operators from the hash index
+    MathOP findMathOperator(const std::string &name) const {
+        MathOP op = stringToMathOP(name);
+        if (op != MathOPCount) return op;
+        auto found = core->mathOperatorIndex.find(name);
+        if (found == core->mathOperatorIndex.end()) return MathOPCount;
+        return static_cast<MathOP>(MathOPCount + 1 + found->second);
+    }
+
+    // Number of values following the operator, -1 when the operator is unknown
+    int mathOperandCount(MathOP op) const {
+        if (op == MathOP::EMPTY) return 0;
+        if (op < MathOP::MathOPCount) return 1;
+        auto math_operator = customMathOperator(op);
+        return math_operator == nullptr ? -1 : math_operator->operands;
+    }
+
+    std::string mathOperatorName(MathOP op) const {
+        auto math_operator = customMathOperator(op);
+        return math_operator == nullptr ? mathOPToString(op) : std::string(math_operator->name);
+    }
+
+    // Same as above, every operation on the variable is clamped to [min, max] as part of the operation
+    template<typename T>
+    bool registerMathCommand(std::string name, T& value, typename std::enable_if<true, T>::type min, typename std::enable_if<true, T>::type max,
+                             std::function<std::string(Stream& stream, double value, MathOP op)> callback, std::string description = "") {
+        if (!registerMathCommand(name, value, callback, description)) return false;
+        WriteLock lock(activeGuard());
+        mathCommandDefinition.back().value.setBounds<T>(min, max);
+        return true;
+    }
+
+    // Registers a whole table without copying it, the table has to outlive the parser. Sorted tables (by name) are
+    // binary searched, others scanned. Static commands can't be removed, registering the same name at runtime overrides one.
+    //   static constexpr CommandParser::StaticCommand commands[] = {{"reset", "", &reset, "Reboots the board"}, ...};
+    //   parser.registerStaticCommands(commands);
+    bool registerStaticCommands(const StaticCommand *commands, size_t count) {
+        WriteLock lock(activeGuard());
+        bool sorted = true;
+        std::vector<StaticEntry> entries(count);
+        size_t widest = 0;
+        for (size_t i = 0; i < count; ++i) {
+            std::string_view name = commands[i].name;
+            if (name.empty() || commands[i].callback == nullptr || !compilePlan(commands[i].argTypes, entries[i].plan)) return false;
+            for (char c : name) {
+                if (c != tolower(c)) return false;
+            }
+            if (hasGroup(std::string(name))) return false;
+            if (i > 0 && !(std::string_view(commands[i - 1].name) < name)) sorted = false;
+            widest = std::max(widest, entries[i].plan.slots.size());
+        }
+        core->commandArgViews.reserve(std::max(core->commandArgViews.capacity(), widest));
+        staticTables.push_back(StaticTable{commands, count, nextCommandId, sorted, std::move(entries)});
+        nextCommandId += count;
+        return true;
+    }
+
+    template<size_t N>
+    bool registerStaticCommands(const StaticCommand (&commands)[N]) {
+        return registerStaticCommands(commands, N);
+    }
+
+    // "motor left pid kp set 1.2": registerGroup("motor")->registerGroup("left")->registerGroup("pid") then register kp
+    // on the last one. Every level only matches and completes its own children. Returns the group's level, a parser
+    // holding only its tables and sharing the root's state, the same one again for an existing group, nullptr when a
+    // command already has the name, and registering a command under a group's name fails the same way. Groups are
+    // reached by text only, the binary protocol addresses the root's commands.
+    CommandParser *registerGroup(std::string name, std::string description = "") {
+        WriteLock lock(activeGuard());
+        for (auto &c : name) {
+            c = tolower(c);
+        }
+        if (name.empty() || name.find_first_of(" \t\r\n") != std::string::npos) return nullptr;
+        auto found = commandIndex.find(name);
+        if (found != commandIndex.end()) {
+            if (found->second.group != CommandIndex::npos) return groups[found->second.group].parser.get();
+            if (found->second.command != CommandIndex::npos || found->second.math != CommandIndex::npos) return nullptr;
+        }
+        if (findStaticCommand(name) != nullptr) return nullptr;
+        groups.push_back(CommandGroup{name, description, std::unique_ptr<CommandParser>(new CommandParser(GroupLevel{}, *this))});
+        commandIndex[name].group = groups.size() - 1;
+        completionTrie.insert(name, CommandTrie::GROUP);
+        return groups.back().parser.get();
+    }
+
+    [[nodiscard]] CommandParser *group(std::string name) {
+        for (auto &c : name) {
+            c = tolower(c);
+        }
+        auto found = commandIndex.find(name);
+        if (found == commandIndex.end() || found->second.group == CommandIndex::npos) return nullptr;
+        return groups[found->second.group].parser.get();
+    }
+
+    // Removes the group with everything registered in it
+    bool removeGroup(std::string name) {
+        WriteLock lock(activeGuard());
+        for (auto &c : name) {
+            c = tolower(c);
+        }
+        CommandParser *removed = group(name);
+        if (removed != nullptr) dropWatchesIn(*removed);
+        if (!callRemoveOn(groups, [&name](const CommandGroup& a){return a.name == name;}))
+            return false;
+        rebuildIndex();
+        completionTrie.remove(name, CommandTrie::GROUP);
+        return true;
+    }
+
+    // Calls visitor(name, description, CommandParser& group) for every group of this level
+    template<typename Visitor>
+    void for_each_group(Visitor &&visitor) const {
+        for (auto &group : groups) {
+            visitor(std::string_view(group.name), std::string_view(group.description), *group.parser);
+        }
+    }
+
+    // "rearm" as "motor stop; pos set 0; motor arm $1": every step is looked up and gets its arguments parsed here,
+    // running the macro goes straight to the callbacks. $1 to $9 take the arguments of the call and $* all of them,
+    // steps using them are parsed on every run. A macro is a command of its own, completed and listed like one, and
+    // can be a step of another. Defining an existing macro again replaces its steps, any other taken name is refused.
+    bool defineMacro(const std::string &name, std::string_view body, const std::string &description = "") {
+        WriteLock lock(activeGuard());
+        std::string response;
+        return addMacro(name, body, description, response);
+    }
+
+    bool removeMacro(std::string name) {
+        WriteLock lock(activeGuard());
+        for (auto &c : name) {
+            c = tolower(c);
+        }
+        return findMacro(name) != nullptr && eraseCommand(name);
+    }
+
+    // Calls visitor(name, body) for every macro
+    template<typename Visitor>
+    void for_each_macro(Visitor &&visitor) const {
+        for (auto &macro : macros) {
+            visitor(std::string_view(macro->name), std::string_view(macro->body));
+        }
+    }
+
+    // "macro" lists the macros, "macro name" removes one and "macro name steps..." defines it. The command changes the
+    // registry from inside a line, with an executor define them with defineMacro from the handler core instead.
+    bool register_macro_command(const std::string &name = COMMAND_PARSER_MACRO_COMMAND) {
+        WriteLock lock(activeGuard());
+        TypedInvoker invoker = [this](std::string_view args, std::string &response, Stream& stream) {
+            std::string_view macroName = nextToken(args);
+            skipWhitespace(args);
+            trimBack(args);
+            if (macroName.empty()) {
+                response.clear();
+                for (auto &macro : macros) {
+                    stream.print(macro->name.c_str());
+                    stream.print(PSTR(": "));
+                    stream.print(macro->body.c_str());
+                    stream.print(PSTR("\r\n"));
+                }
+                return true;
+            }
+            std::string lowered(macroName);
+            for (auto &c : lowered) {
+                c = tolower(c);
+            }
+            if (args.empty()) {
+                if (findMacro(lowered) == nullptr || !eraseCommand(lowered)) {
+                    response = commandErrorMessage(ERROR_UNKNOWN_COMMAND);
+                    return false;
+                }
+                response.assign(PSTR("Macro removed."));
+                return true;
+            }
+            // Redefining keeps the description given to defineMacro
+            Macro *existing = findMacro(lowered);
+            std::string description = existing != nullptr ? commandDefinitions[commandIndex[lowered].command].description : "";
+            if (!addMacro(lowered, args, description, response)) return false;
+            response.assign(PSTR("Macro defined."));
+            return true;
+        };
+        if (!addCommand(name, "", invoker, PSTR("Lists macros, 'name' removes one, 'name step; step $1' defines one"))) return false;
+        // Called by id there is no text to parse, the command only lists
+        commandDefinitions.back().viewCallback = [invoker](ArgumentSpan, Stream& stream) mutable {
+            std::string response;
+            invoker(std::string_view(), response, stream);
+            return response;
+        };
+        return true;
+    }
+
+private:
+    // A running macro can't be removed, its steps are still in use
+    bool eraseCommand(const std::string &name) {
+        Macro *macro = findMacro(name);
+        if (macro != nullptr && macro->running) return false;
+        if (!callRemoveOn(commandDefinitions, [&name](const Command& a){return a.name == name;}))
+            return false;
+        if (macro != nullptr) callRemoveOn(macros, [macro](const std::unique_ptr<Macro>& a){return a.get() == macro;});
+        rebuildIndex();
+        auto found = commandIndex.find(name);
+        if (found == commandIndex.end() || found->second.command == CommandIndex::npos)
+            completionTrie.remove(name, CommandTrie::COMMAND);
+        return true;
+    }
+
+    bool addMacro(std::string name, std::string_view body, const std::string &description, std::string &response) {
+        for (auto &c : name) {
+            c = tolower(c);
+        }
+        if (name.empty() || name.find_first_of(" \t\r\n;$") != std::string::npos) {
+            response = commandErrorMessage(ERROR_INVALID_STRING);
+            return false;
+        }
+        Macro *existing = findMacro(name);
+        if (existing == nullptr && (commandIndex.count(name) != 0 || findStaticCommand(name) != nullptr)) {
+            response.assign(PSTR("Error: Name already in use."));
+            return false;
+        }
+        if (existing != nullptr && existing->running) {
+            response = commandErrorMessage(ERROR_MACRO_RECURSION);
+            return false;
+        }
+        auto macro = std::make_unique<Macro>();
+        macro->name = name;
+        macro->body.assign(body.data(), body.size());
+        if (!resolveMacro(*macro, response)) return false;
+        if (existing != nullptr) {
+            // Moving the vector keeps the steps, and the views into their texts, where they are
+            existing->body = std::move(macro->body);
+            existing->steps = std::move(macro->steps);
+            existing->version = macro->version;
+            commandDefinitions[commandIndex[name].command].description = description;
+            return true;
+        }
+        Macro *defined = macro.get();
+        macros.push_back(std::move(macro));
+        TypedInvoker invoker = [this, defined](std::string_view args, std::string &response, Stream& stream) {
+            return runMacro(*defined, args, response, stream);
+        };
+        addCommand(name, "", invoker, description);
+        // Called by id the macro gets no parameters
+        commandDefinitions.back().viewCallback = [this, defined](ArgumentSpan, Stream& stream) {
+            std::string response;
+            runMacro(*defined, std::string_view(), response, stream);
+            return response;
+        };
+        return true;
+    }
+
+public:
+    template<typename Container, typename T>
+    bool callRemoveOn(Container& c, T a) {
+        auto id = std::find_if(c.begin(), c.end(), a);
+        if (id != c.end()) {
+            c.erase(id);
+            return true;
+        }
+        return false;
+    }
+
+    bool removeCommand(std::string name) {
+        WriteLock lock(activeGuard());
+        for (auto &c : name) {
+            c = tolower(c);
+        }
+        return eraseCommand(name);
+    }
+
+    bool removeMathCommand(std::string name) {
+        WriteLock lock(activeGuard());
+        for (auto &c : name) {
+            c = tolower(c);
+        }
+        if (!callRemoveOn(mathCommandDefinition, [&name](const MathCommand& a){
+            return a.name == name;
+        }))
+            return false;
+        rebuildIndex();
+        if (findMathCommand(name) == nullptr)
+            completionTrie.remove(name, CommandTrie::MATH);
+        return true;
+    }
+
+    bool removeAllCommands(std::string name) {
+        bool a = removeMathCommand(name);
+        bool b = removeCommand(name);
+
+        return a | b;
+    }
+
+
+    // Completes a partially typed line: returns the number of candidate names, puts their longest common prefix in
+    // commonPrefix and calls visit(candidate, description) for each one. Once a math command name and a space are
+    // typed, its operators are offered instead.
+    template<typename Visitor>
+    size_t complete(std::string_view cmd, std::string &commonPrefix, Visitor &&visit) {
+        ReadLock lock(activeGuard());
+        return completeLine(cmd, commonPrefix, visit);
+    }
+
+    size_t complete(std::string_view cmd, std::string &commonPrefix) {
+        return complete(cmd, commonPrefix, [](std::string_view, std::string_view) {});
+    }
+
+private:
+    // complete() below the guard. The groups named in full are entered first, in one walk so the root's guard is only
+    // taken once, then the last level completes the rest and its candidates get the group names back in front.
+    template<typename Visitor>
+    size_t completeLine(std::string_view cmd, std::string &commonPrefix, Visitor &visit) {
+        auto &state = *core;
+        state.completionLookup.assign(cmd.data(), cmd.size());
+        for (auto &c : state.completionLookup) {
+            c = tolower(c);
+        }
+        state.completionPath.clear();
+        std::string_view line(state.completionLookup);
+        CommandParser *level = this;
+        while (true) {
+            uint8_t kinds;
+            size_t count = level->completionTrie.common_prefix(line, commonPrefix, kinds);
+            if (count != 0) {
+                if (kinds == CommandTrie::MATH || kinds == CommandTrie::GROUP) commonPrefix += ' ';
+                level->completionTrie.for_each_match(line, [level, &state, &visit](std::string_view name, uint8_t matchKinds) {
+                    state.completionName.assign(name.data(), name.size());
+                    auto &entry = level->commandIndex.find(state.completionName)->second;
+                    state.completionName.insert(0, state.completionPath);
+                    if (matchKinds & CommandTrie::COMMAND) {
+                        visit(std::string_view(state.completionName), std::string_view(level->commandDefinitions[entry.command].description));
+                    }
+                    if (matchKinds & CommandTrie::MATH) {
+                        state.completionName += ' ';
+                        visit(std::string_view(state.completionName), std::string_view(level->mathCommandDefinition[entry.math].description));
+                    }
+                    if (matchKinds & CommandTrie::GROUP) {
+                        state.completionName.assign(state.completionPath).append(name.data(), name.size()).append(" ");
+                        visit(std::string_view(state.completionName), std::string_view(level->groups[entry.group].description));
+                    }
+                });
+            }
+            for (auto &table : level->staticTables) {
+                for (size_t i = 0; i < table.count; ++i) {
+                    std::string_view name = table.commands[i].name;
+                    if (name.substr(0, line.size()) != line) continue;
+                    // A runtime name shadows it, dispatch would run that one and the trie already offered it
+                    state.completionName.assign(name.data(), name.size());
+                    if (level->commandIndex.count(state.completionName) != 0) continue;
+                    if (count == 0) {
+                        commonPrefix.assign(name.data(), name.size());
+                    } else {
+                        size_t shared = 0;
+                        while (shared < commonPrefix.size() && shared < name.size() && commonPrefix[shared] == name[shared]) ++shared;
+                        commonPrefix.resize(shared);
+                    }
+                    count++;
+                    state.completionName.assign(state.completionPath).append(name.data(), name.size());
+                    visit(std::string_view(state.completionName), std::string_view(table.commands[i].description));
+                }
+            }
+            if (count != 0) {
+                commonPrefix.insert(0, state.completionPath);
+                return count;
+            }
+
+            auto first_alpha = line.find_first_of(PSTR("abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRTSUVWXYZ"));
+            if (first_alpha == std::string_view::npos) return 0;
+            line.remove_prefix(first_alpha);
+            std::string_view name = nextToken(line);
+            if (line.empty()) return 0;
+            skipWhitespace(line);
+            state.completionName.assign(name.data(), name.size());
+            auto found = level->commandIndex.find(state.completionName);
+            if (found == level->commandIndex.end() || found->second.group == CommandIndex::npos) {
+                return level->completeOperators(state.completionName, line, commonPrefix, visit);
+            }
+            // The rest of the line is completed by the group
+            auto &group = level->groups[found->second.group];
+            state.completionPath.append(group.name).append(" ");
+            level = group.parser.get();
+        }
+    }
+
+    // "kp s" offers the operators of the variable kp starting with "s"
+    template<typename Visitor>
+    size_t completeOperators(const std::string &variable, std::string_view line, std::string &commonPrefix, Visitor &visit) {
+        auto &state = *core;
+        auto it_math = findMathCommand(variable);
+        if (it_math == nullptr) return 0;
+        size_t count = 0;
+        auto offer = [&](std::string_view op) {
+            if (op.empty() || op.substr(0, line.size()) != line) return;
+            state.completionName.assign(state.completionPath).append(it_math->name).append(" ").append(op);
+            if (count == 0) {
+                commonPrefix = state.completionName;
+            } else {
+                size_t shared = 0;
+                while (shared < commonPrefix.size() && shared < state.completionName.size() && commonPrefix[shared] == state.completionName[shared]) ++shared;
+                commonPrefix.resize(shared);
+            }
+            count++;
+            state.completionDescription.assign(PSTR("Using the command ")).append(state.completionName).append(PSTR(" to modify the value of ")).append(it_math->name);
+            visit(std::string_view(state.completionName), std::string_view(state.completionDescription));
+        };
+        for (auto op : mathOP_names) offer(op);
+        for (auto &op : state.mathOperators) offer(op.name);
+        return count;
+    }
+
+public:
+
+    // Kept for existing callers, it copies every candidate, complete() with a visitor doesn't allocate
+    std::tuple<std::vector<std::string>, std::vector<std::string>> tab_complete(std::string cmd) {
+        std::vector<std::string> description;
+        std::vector<std::string> argsStrings;
+        std::string commonPrefix;
+        complete(cmd, commonPrefix, [&description, &argsStrings](std::string_view name, std::string_view text) {
+            argsStrings.emplace_back(name);
+            description.emplace_back(text);
+        });
+        return {description, argsStrings};
+    }
+
+    // A streaming command writes its whole response to the stream before this returns.
+    // With an executor the line is only queued, response stays empty and false means the queue is full.
+    bool processCommand(const std::string &commandStr, std::string &response, Stream& stream) {
+        if (lineExecutor() != nullptr) return submitLine(commandStr, response, stream);
+        return processLine(commandStr, response, stream);
+    }
+
+    // A streaming command hands its generator here instead, for the caller to run turn by turn. An executed one
+    // writes to the executor's stream.
+    bool processCommand(const std::string &commandStr, std::string &response, Stream& stream, CommandGenerator &generator) {
+        if (lineExecutor() != nullptr) return submitLine(commandStr, response, stream);
+        core->generatorOut = &generator;
+        bool ok = processLine(commandStr, response, stream);
+        core->generatorOut = nullptr;
+        return ok;
+    }
+
+    // Runs a block of commands separated by ';' or new lines (outside of quotes). The block is split up front, then the
+    // commands run back to back and every non empty response is appended to responses, one per line.
+    // Returns the number of commands that failed. With an executor the whole block is submitted at once, up to
+    // COMMAND_PARSER_MAX_SUBMITTED_SIZE, its responses come back together through take_finished, and 1 is returned
+    // when it couldn't be queued.
+    size_t processBatch(std::string_view batch, std::string &responses, Stream& stream) {
+        if (lineExecutor() != nullptr) {
+            // batchResponse belongs to the executing side
+            if (submitLine(batch, core->submitText, stream, 0, true)) return 0;
+            responses += core->submitText;
+            responses += "\r\n";
+            return 1;
+        }
+        return runBatch(batch, responses, stream);
+    }
+
+private:
+    size_t runBatch(std::string_view batch, std::string &responses, Stream& stream) {
+        core->batchLines.clear();
+        while (true) {
+            size_t end = statementEnd(batch);
+            core->batchLines.push_back(batch.substr(0, end));
+            if (end == std::string_view::npos) break;
+            batch.remove_prefix(end + 1);
+        }
+
+        size_t failures = 0;
+        for (auto line : core->batchLines) {
+            skipWhitespace(line);
+            if (line.empty()) continue;
+            core->batchResponse.clear();
+            if (!processLine(line, core->batchResponse, stream)) failures++;
+            if (!core->batchResponse.empty()) {
+                responses += core->batchResponse;
+                responses += "\r\n";
+            }
+        }
+        return failures;
+    }
+
+    // Position of the first ';' or line break outside quotes, npos when the text is a single statement
+    static size_t statementEnd(std::string_view text) {
+        bool quoted = false;
+        for (size_t i = 0; i < text.size(); ++i) {
+            char c = text[i];
+            if (c == '"') quoted = !quoted;
+            if (!quoted && (c == ';' || c == '\n' || c == '\r')) return i;
+        }
+        return std::string_view::npos;
+    }
+
+
+    // EMPTY leaves the value untouched and only reports it
+    bool applyMathOp(MathCommand &command, MathOP op, const MathOperand &operand, std::string &response, Stream& stream) {
+        if (op >= MathOP::MathOPCount) {
+            response.assign(commandErrorMessage(ERROR_UNKNOWN_OPERATOR)).append(mathOPToString(op));
+            return false;
+        }
+        PROFILE_CALLBACK();
+        if (!command.value.apply(op, operand)) {
+            response = commandErrorMessage(ERROR_DIVISION_BY_ZERO);
+            return false;
+        }
+        response = command.callback(stream, command.value.get(), op);
+        return true;
+    }
+
+    // Registered operators, the operands array holds exactly mathOperandCount(op) values
+    bool applyMathOp(MathCommand &command, MathOP op, const double *operands, std::string &response, Stream& stream) {
+        const MathOperator *math_operator = customMathOperator(op);
+        if (math_operator == nullptr) {
+            MathOperand operand = mathOperandCount(op) > 0 ? MathOperand(operands[0]) : MathOperand();
+            return applyMathOp(command, op, operand, response, stream);
+        }
+        PROFILE_CALLBACK();
+        command.value.set(math_operator->apply(command.value.get(), operands));
+        response = command.callback(stream, command.value.get(), op);
+        return true;
+    }
+
+    const MathOperator *customMathOperator(MathOP op) const {
+        size_t index = static_cast<size_t>(op) - MathOPCount - 1;
+        return op > MathOPCount && index < core->mathOperators.size() ? &core->mathOperators[index] : nullptr;
+    }
+
+    // Integers are kept as integers when nothing but whitespace follows them, everything else is read as a double
+    static bool parseMathOperand(std::string_view &cursor, MathOperand &operand) {
+        std::string_view probe = cursor;
+        int64_t integer;
+        if (parseInteger(probe, integer) && (probe.empty() || std::isspace(probe[0]))) {
+            operand = MathOperand(integer);
+            cursor = probe;
+            return true;
+        }
+        double real;
+        if (!parseDouble(cursor, real)) return false;
+        operand = MathOperand(real);
+        return true;
+    }
+
+#ifdef COMMAND_PARSER_PROFILING
+
+    // A group's line is measured by the root, its commands are charged there
+    void profileCommand(CommandStats &stats) {
+        core->profiled = &stats;
+    }
+
+    void profileCallback() {
+        core->callbackStart = micros();
+    }
+
+    // Runs one line or one binary request and charges its time and outcome to the command it reached
+    template<typename Run>
+    bool profile(std::string &response, Run &&run) {
+        ReadLock lock(activeGuard());
+        core->profiled = nullptr;
+        core->profileStart = micros();
+        core->callbackStart = 0;
+        bool ok = run();
+        unsigned long end = micros();
+        core->parserStats.lines++;
+        core->parserStats.peakResponseSize = std::max(core->parserStats.peakResponseSize, response.size());
+        if (!ok) core->parserStats.errors[commandErrorFromResponse(response)]++;
+        if (core->profiled != nullptr) {
+            unsigned long parsed = core->callbackStart != 0 ? core->callbackStart : end;
+            core->profiled->calls++;
+            if (!ok) core->profiled->errors++;
+            core->profiled->parseMicros += parsed - core->profileStart;
+            core->profiled->callbackMicros += end - parsed;
+            core->profiled->maxCallbackMicros = std::max<uint32_t>(core->profiled->maxCallbackMicros, end - parsed);
+        }
+        return ok;
+    }
+#else
+    template<typename Run>
+    bool profile(std::string &, Run &&run) {
+        ReadLock lock(activeGuard());
+        return run();
+    }
+#endif
+
+    bool processLine(std::string_view command, std::string &response, Stream& stream) {
+        return profile(response, [&]() { return runLine(command, response, stream); });
+    }
+
+    bool runLine(std::string_view command, std::string &response, Stream& stream) {
+        // Single cursor over the caller's buffer, arguments are consumed by advancing it
+        trimBack(command);
+        auto first_alpha = command.find_first_of(PSTR("abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRTSUVWXYZ"));
+        command.remove_prefix(first_alpha == std::string_view::npos ? command.size() : first_alpha);
+
+        // Only the name token is lowercased, into a reused buffer, for the lookup
+        std::string_view token = nextToken(command);
+        core->lookupName.assign(token.data(), token.size());
+        for (auto &c : core->lookupName) {
+            c = tolower(c);
+        }
+        skipWhitespace(command);
+
+        auto found = commandIndex.find(core->lookupName);
+        if (found != commandIndex.end() && found->second.group != CommandIndex::npos) {
+            if (command.empty()) {
+                response = commandErrorMessage(ERROR_MISSING_SUBCOMMAND);
+                return false;
+            }
+            // The line stays measured and guarded by the root, whose state the group shares
+            return groups[found->second.group].parser->runLine(command, response, stream);
+        }
+        if (found == commandIndex.end()) {
+            auto staticCommand = findStaticCommand(core->lookupName);
+            if (staticCommand == nullptr) {
+                response = commandErrorMessage(ERROR_UNKNOWN_COMMAND);
+                return false;
+            }
+            auto &entry = staticEntry(staticCommand);
+            PROFILE_COMMAND(entry);
+            if (!parseArguments(entry.plan, command, response)) return false;
+            PROFILE_CALLBACK();
+            response = staticCommand->callback(ArgumentSpan{core->commandArgViews.data(), core->commandArgViews.size()}, stream);
+            return true;
+        }
+
+        if (found->second.command == CommandIndex::npos) {
+            auto it_math = &mathCommandDefinition[found->second.math];
+            PROFILE_COMMAND(*it_math);
+            MathRequest request;
+            if (!parseMathRequest(command, request, response)) return false;
+            return runMath(*it_math, request, response, stream);
+        }
+
+        auto it = &commandDefinitions[found->second.command];
+        PROFILE_COMMAND(*it);
+        if (it->invoker) {
+            PROFILE_CALLBACK();
+            return it->invoker(command, response, stream);
+        }
+        if (!parseArguments(it->plan, command, response)) return false;
+        return dispatch(*it, ArgumentSpan{core->commandArgViews.data(), core->commandArgViews.size()}, response, stream);
+    }
+
+    bool parseMathRequest(std::string_view command, MathRequest &request, std::string &response) {
+        if (command.empty()) {
+            request.op = MathOP::EMPTY;
+            return true;
+        }
+        std::string_view opToken = nextToken(command);
+        core->operatorName.assign(opToken.data(), opToken.size());
+        for (auto &c : core->operatorName) {
+            c = tolower(c);
+        }
+        skipWhitespace(command);
+        request.op = findMathOperator(core->operatorName);
+        if (request.op == MathOP::MathOPCount || request.op == MathOP::EMPTY) {
+            response.assign(commandErrorMessage(ERROR_UNKNOWN_OPERATOR)).append(core->operatorName);
+            return false;
+        }
+        int operandCount = mathOperandCount(request.op);
+        if (operandCount > 0 && command.empty()) {
+            response = commandErrorMessage(ERROR_MISSING_MATH_VALUE);
+            return false;
+        }
+        if (request.op < MathOP::MathOPCount) {
+            if (!parseMathOperand(command, request.operand)) {
+                response = commandErrorMessage(ERROR_INVALID_DOUBLE);
+                return false;
+            }
+            return true;
+        }
+        for (int i = 0; i < operandCount; ++i) {
+            skipWhitespace(command);
+            if (!parseDouble(command, request.operands[i])) {
+                response = commandErrorMessage(ERROR_INVALID_DOUBLE);
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool runMath(MathCommand &command, const MathRequest &request, std::string &response, Stream& stream) {
+        if (request.op == MathOP::EMPTY) {
+            PROFILE_CALLBACK();
+            response = command.callback(stream, command.value.get(), MathOP::EMPTY);
+            return true;
+        }
+        if (request.op < MathOP::MathOPCount) return applyMathOp(command, request.op, request.operand, response, stream);
+        return applyMathOp(command, request.op, request.operands, response, stream);
+    }
+
+    Macro *findMacro(const std::string &name) {
+        for (auto &macro : macros) {
+            if (macro->name == name) return macro.get();
+        }
+        return nullptr;
+    }
+
+    // Splits the body on ';' outside quotes like a batch, looks every step up and parses the arguments of the ones without parameters
+    bool resolveMacro(Macro &macro, std::string &response) {
+        macro.steps.clear();
+        std::string_view body = macro.body;
+        while (!body.empty()) {
+            auto end = statementEnd(body);
+            std::string_view text = body.substr(0, end);
+            body.remove_prefix(end == std::string_view::npos ? body.size() : end + 1);
+            trimBack(text);
+            skipWhitespace(text);
+            if (text.empty()) continue;
+            std::string_view rest = text;
+            std::string_view token = nextToken(rest);
+            skipWhitespace(rest);
+            core->lookupName.assign(token.data(), token.size());
+            for (auto &c : core->lookupName) {
+                c = tolower(c);
+            }
+            macro.steps.emplace_back();
+            auto &step = macro.steps.back();
+            auto found = commandIndex.find(core->lookupName);
+            Macro *target = found != commandIndex.end() ? findMacro(core->lookupName) : nullptr;
+            if (target != nullptr) {
+                step.kind = MacroStep::MACRO;
+                step.macro = target;
+            } else if (found != commandIndex.end() && found->second.group == CommandIndex::npos) {
+                bool isCommand = found->second.command != CommandIndex::npos;
+                step.kind = isCommand ? MacroStep::COMMAND : MacroStep::MATH;
+                step.index = isCommand ? found->second.command : found->second.math;
+            } else if (found != commandIndex.end() || findStaticCommand(core->lookupName) != nullptr) {
+                rest = text;
+            } else {
+                response.assign(commandErrorMessage(ERROR_UNKNOWN_COMMAND)).append(" ").append(token);
+                return false;
+            }
+            step.text.assign(rest.data(), rest.size());
+            step.substituted = rest.find('$') != std::string_view::npos;
+        }
+        // Second pass, the views point into the texts and the vector won't move anymore
+        for (auto &step : macro.steps) {
+            if (step.substituted) continue;
+            if (step.kind == MacroStep::MATH) {
+                if (!parseMathRequest(step.text, step.math, response)) return false;
+            } else if (step.kind == MacroStep::COMMAND) {
+                std::string_view cursor = step.text;
+                if (!parseArguments(commandDefinitions[step.index].plan, cursor, response)) return false;
+                step.args = core->commandArgViews;
+            }
+        }
+        macro.version = registryVersion;
+        return true;
+    }
+
+    struct MacroParameters {
+        std::array<std::string_view, MACRO_MAX_PARAMETERS> values;
+        size_t count = 0;
+        std::string_view all;
+    };
+
+    static void substituteParameters(std::string_view text, const MacroParameters &parameters, std::string &line) {
+        line.clear();
+        for (size_t i = 0; i < text.size(); ++i) {
+            char next = i + 1 < text.size() ? text[i + 1] : 0;
+            if (text[i] == '$' && next >= '1' && next < '1' + MACRO_MAX_PARAMETERS) {
+                size_t n = next - '1';
+                if (n < parameters.count) line.append(parameters.values[n]);
+                ++i;
+            } else if (text[i] == '$' && next == '*') {
+                line.append(parameters.all);
+                ++i;
+            } else {
+                line += text[i];
+            }
+        }
+    }
+
+    bool runMacroStep(Macro &macro, MacroStep &step, const MacroParameters &parameters, Stream& stream) {
+        auto &response = macro.stepResponse;
+        if (!step.substituted) {
+            switch (step.kind) {
+                case MacroStep::COMMAND:
+                    return dispatch(commandDefinitions[step.index], ArgumentSpan{step.args.data(), step.args.size()}, response, stream);
+                case MacroStep::MATH:
+                    return runMath(mathCommandDefinition[step.index], step.math, response, stream);
+                case MacroStep::MACRO:
+                    return runMacro(*step.macro, step.text, response, stream);
+                case MacroStep::LINE:
+                    return runLine(step.text, response, stream);
+            }
+        }
+        substituteParameters(step.text, parameters, macro.line);
+        std::string_view text = macro.line;
+        switch (step.kind) {
+            case MacroStep::COMMAND: {
+                auto &command = commandDefinitions[step.index];
+                if (command.invoker) return command.invoker(text, response, stream);
+                if (!parseArguments(command.plan, text, response)) return false;
+                return dispatch(command, ArgumentSpan{core->commandArgViews.data(), core->commandArgViews.size()}, response, stream);
+            }
+            case MacroStep::MATH: {
+                MathRequest request;
+                if (!parseMathRequest(text, request, response)) return false;
+                return runMath(mathCommandDefinition[step.index], request, response, stream);
+            }
+            case MacroStep::MACRO:
+                return runMacro(*step.macro, text, response, stream);
+            case MacroStep::LINE:
+                break;
+        }
+        return runLine(text, response, stream);
+    }
+
+    // Runs the steps in order and stops at the first failing one, the responses are joined line by line. Streaming
+    // steps write straight to the stream so the output keeps the steps' order.
+    bool runMacro(Macro &macro, std::string_view args, std::string &response, Stream& stream) {
+        if (macro.running) {
+            response = commandErrorMessage(ERROR_MACRO_RECURSION);
+            return false;
+        }
+        if (macro.version != registryVersion && !resolveMacro(macro, response)) return false;
+        MacroParameters parameters;
+        trimBack(args);
+        skipWhitespace(args);
+        parameters.all = args;
+        while (!args.empty() && parameters.count < parameters.values.size()) {
+            parameters.values[parameters.count++] = nextToken(args);
+            skipWhitespace(args);
+        }
+        macro.running = true;
+        CommandGenerator *out = core->generatorOut;
+        core->generatorOut = nullptr;
+        response.clear();
+        bool ok = true;
+        for (auto &step : macro.steps) {
+            // A step removed something this macro points to
+            if (macro.version != registryVersion) {
+                macro.stepResponse = commandErrorMessage(ERROR_UNKNOWN_COMMAND);
+                ok = false;
+            } else {
+                macro.stepResponse.clear();
+                ok = runMacroStep(macro, step, parameters, stream);
+            }
+            if (!macro.stepResponse.empty()) {
+                if (!response.empty()) response += PSTR("\r\n");
+                response += macro.stepResponse;
+            }
+            if (!ok) break;
+        }
+        core->generatorOut = out;
+        macro.running = false;
+        return ok;
+    }
+
+    // Fills commandArgViews following the plan, the whole cursor has to be consumed. Once an optional argument is
+    // missing the remaining ones stay empty.
+    bool parseArguments(const ArgumentPlan &plan, std::string_view &command, std::string &response) {
+        core->commandArgViews.assign(plan.slots.size(), ArgumentView());
+        for (size_t i = 0; i < plan.slots.size(); ++i) {
+            skipWhitespace(command);
+            if (plan.slots[i].parse(command, core->commandArgViews[i])) continue;
+            response = argumentError(plan.slots[i].type);
+            if (i < plan.required) return false;
+            break;
+        }
+        skipWhitespace(command);
+        if (!command.empty()) {
+            response = commandErrorMessage(ERROR_TOO_MANY_ARGUMENTS);
+            return false;
+        }
+        return true;
+    }
+
+    void release(PendingCommand &slot) {
+        slot.generation++;
+        slot.stream = nullptr;
+        slot.state.store(PendingCommand::FREE, std::memory_order_release);
+    }
+
+    // The result buffers are only allocated once something can be pending
+    void reservePending() {
+        for (auto &slot : core->pending) slot.response.reserve(MAX_RESPONSE_SIZE);
+    }
+
+    // Takes a free slot for a command started from stream, an empty token when all are in use
+    AsyncToken claimPending(uint16_t id, const Stream &stream) {
+        for (size_t i = 0; i < core->pending.size(); ++i) {
+            auto &slot = core->pending[i];
+            uint8_t expected = PendingCommand::FREE;
+            if (!slot.state.compare_exchange_strong(expected, PendingCommand::RUNNING, std::memory_order_acquire)) continue;
+            slot.id = id;
+            slot.stream = &stream;
+            slot.response.clear();
+            return AsyncToken{static_cast<uint8_t>(i), slot.generation};
+        }
+        return AsyncToken{};
+    }
+
+    bool startAsync(const Command &command, ArgumentSpan args, std::string &response, Stream& stream) {
+        AsyncToken token = claimPending(command.id, core->asyncOrigin != nullptr ? *core->asyncOrigin : stream);
+        if (!token) {
+            response = commandErrorMessage(ERROR_TOO_MANY_PENDING);
+            return false;
+        }
+        response.clear();
+        command.asyncCallback(args, stream, token);
+        return true;
+    }
+
+
+    static void appendDouble(double value, std::string &line) {
+        char text[32];
+        snprintf(text, sizeof(text), " %.17g", value);
+        line += text;
+    }
+
+    // Decoded arguments back as text that parses to the same values. A string with a quote that would need quoting
+    // (or starting with one) has no such text.
+    static bool appendArguments(std::string_view argTypes, ArgumentSpan args, std::string &line) {
+        size_t slot = 0;
+        char text[32];
+        for (char type : argTypes) {
+            if (type == 'o') continue;
+            if (slot >= args.size() || !args[slot]) break;
+            auto &arg = args[slot++];
+            switch (type) {
+                case 'd': appendDouble(arg.asDouble(), line); break;
+                case 'u': snprintf(text, sizeof(text), " %llu", static_cast<unsigned long long>(arg.asUInt64())); line += text; break;
+                case 'i': snprintf(text, sizeof(text), " %lld", static_cast<long long>(arg.asInt64())); line += text; break;
+                case 's': {
+                    std::string_view value = arg.asString();
+                    bool needsQuotes = value.empty() || value.find_first_of(" \t\r\n") != std::string_view::npos || value[0] == '"';
+                    if (needsQuotes && value.find('"') != std::string_view::npos) return false;
+                    line += ' ';
+                    if (needsQuotes) line += '"';
+                    line.append(value.data(), value.size());
+                    if (needsQuotes) line += '"';
+                    break;
+                }
+            }
+        }
+        return true;
+    }
+
+    uint8_t linePriority(std::string_view line) {
+        ReadLock lock(activeGuard());
+        return priorityOf(line);
+    }
+
+    // Groups are walked under the caller's guard
+    uint8_t priorityOf(std::string_view line) {
+        skipWhitespace(line);
+        std::string_view token = nextToken(line);
+        core->submitName.assign(token.data(), token.size());
+        for (auto &c : core->submitName) {
+            c = tolower(c);
+        }
+        auto found = commandIndex.find(core->submitName);
+        if (found == commandIndex.end()) return 0;
+        if (found->second.group != CommandIndex::npos) return groups[found->second.group].parser->priorityOf(line);
+        if (found->second.command != CommandIndex::npos) return commandDefinitions[found->second.command].priority;
+        if (found->second.math != CommandIndex::npos) return mathCommandDefinition[found->second.math].priority;
+        return 0;
+    }
+
+    // Hands the line to the executor, the handler of stream prints its result once it ran. id is the one the result
+    // is taken with, the binary protocol's request id.
+    bool submitLine(std::string_view line, std::string &response, Stream& stream, uint16_t id = 0, bool batch = false) {
+        if (line.size() > COMMAND_PARSER_MAX_SUBMITTED_SIZE) {
+            response = commandErrorMessage(ERROR_LINE_TOO_LONG);
+            return false;
+        }
+        AsyncToken token = claimPending(id, stream);
+        if (!token) {
+            response = commandErrorMessage(ERROR_TOO_MANY_PENDING);
+            return false;
+        }
+        auto &slot = core->pending[token.slot];
+        slot.batch = batch;
+        // A batch stays whole here rather than in pieces over several queue slots, its responses come back together
+        slot.stored = batch || line.size() > core->executor->max_line_size();
+        if (slot.stored) slot.text.assign(line.data(), line.size());
+        if (!core->executor->submit(slot.stored ? line.substr(0, 0) : line, token, linePriority(line))) {
+            release(core->pending[token.slot]);
+            response = commandErrorMessage(ERROR_TOO_MANY_PENDING);
+            return false;
+        }
+        response.clear();
+        return true;
+    }
+
+    bool dispatch(const Command &command, ArgumentSpan args, std::string &response, Stream& stream) {
+        PROFILE_CALLBACK();
+        if (command.asyncCallback) {
+            return startAsync(command, args, response, stream);
+        }
+        if (command.streamCallback) {
+            response.clear();
+            auto generator = command.streamCallback(args, stream);
+            if (!generator) return true;
+            if (core->generatorOut != nullptr) {
+                *core->generatorOut = std::move(generator);
+                return true;
+            }
+            for (bool done = false; !done;) {
+                ResponseWriter out(stream, static_cast<size_t>(-1));
+                done = generator(out);
+            }
+            return true;
+        }
+        if (command.writeCallback) {
+            response.clear();
+            ResponseBuffer buffer(response);
+            command.writeCallback(args, stream, buffer);
             return true;
         }
-        return false;
-    }
-
-    bool removeCommand(std::string name) {
-        for (auto &c : name) {
-            c = tolower(c);
+        if (command.viewCallback) {
+            response = command.viewCallback(args, stream);
+            return true;
         }
-        return callRemoveOn(commandDefinitions, [name](auto a){return a.name == name;});
-    }
-
-    bool removeMathCommand(std::string name) {
-        for (auto &c : name) {
-            c = tolower(c);
+        // Reserved at registration, the vector itself never reallocates here
+        core->commandArgs.resize(args.size());
+        for (size_t i = 0; i < args.size(); ++i) {
+            core->commandArgs[i] = Argument(args[i]);
         }
-        return callRemoveOn(mathCommandDefinition, [name](auto a){
-            return a.name == name;
-        });
+        response = command.callback(core->commandArgs, stream);
+        return true;
     }
 
-    bool removeAllCommands(std::string name) {
-        bool a = removeMathCommand(name);
-        bool b = removeCommand(name);
+public:
 
-        return a | b;
+    [[nodiscard]] const Command *command_by_id(uint16_t id) const {
+        auto found = idIndex.find(id);
+        if (found == idIndex.end() || found->second.command == CommandIndex::npos) return nullptr;
+        return &commandDefinitions[found->second.command];
     }
 
+    [[nodiscard]] const MathCommand *math_command_by_id(uint16_t id) const {
+        auto found = idIndex.find(id);
+        if (found == idIndex.end() || found->second.math == CommandIndex::npos) return nullptr;
+        return &mathCommandDefinition[found->second.math];
+    }
 
-    std::tuple<std::vector<std::string>, std::vector<std::string>> tab_complete(std::string cmd) {
-        std::vector<std::string> description;
-        std::vector<std::string> argsStrings;
-        for (auto&c : cmd) {
-            c = tolower(c);
+    [[nodiscard]] const StaticCommand *static_command_by_id(uint16_t id) const {
+        for (auto &table : staticTables) {
+            if (id >= table.firstId && static_cast<size_t>(id - table.firstId) < table.count) return &table.commands[id - table.firstId];
         }
-        for (auto &cmd_data: command_definitions()) {
-            if (cmd_data.name.rfind(cmd, 0) == 0) {
-                description.push_back(cmd_data.description);
-                argsStrings.push_back(cmd_data.name);
+        return nullptr;
+    }
+
+    // Runs the command with this id on arguments that are already decoded, they have to follow its argTypes.
+    // With an executor the request is written back as a line and submitted, its result is taken with the id.
+    bool invoke(uint16_t id, ArgumentSpan args, std::string &response, Stream& stream) {
+        if (lineExecutor() != nullptr) {
+            auto command = command_by_id(id);
+            auto staticCommand = command == nullptr ? static_command_by_id(id) : nullptr;
+            if (command == nullptr && staticCommand == nullptr) {
+                response = commandErrorMessage(ERROR_UNKNOWN_COMMAND);
+                return false;
             }
-        }
-        for (auto &cmd_data: mathCommandDefinition) {
-            if (cmd_data.name.rfind(cmd, 0) == 0) {
-                description.push_back(cmd_data.description);
-                argsStrings.push_back(cmd_data.name + " ");
+            core->submitText.assign(command != nullptr ? command->name.c_str() : staticCommand->name);
+            if (!appendArguments(command != nullptr ? std::string_view(command->argTypes) : staticCommand->argTypes, args, core->submitText)) {
+                response = commandErrorMessage(ERROR_INVALID_STRING);
+                return false;
             }
+            return submitLine(core->submitText, response, stream, id);
         }
-        if (description.empty()) {
-            std::string command = cmd;
-            auto of = command.find_first_of(PSTR("abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRTSUVWXYZ"));
-            if (of == std::string::npos) {
-                return {description, argsStrings};
-            }
-            command.erase(0, of);
-            const auto empty_char_pos = command.find_first_of(' ');
-            if (empty_char_pos == std::string::npos) {
-                return {description, argsStrings};
-            }
-            std::string name = command.substr(0, empty_char_pos);
-            command.erase(0, empty_char_pos);
-            command.erase(0, command.find_first_not_of(" \n\r\t"));
-            auto it_math = std::find_if(mathCommandDefinition.begin(), mathCommandDefinition.end(),[&name](const MathCommand& cmd){ return cmd.name == name;});
-            if (it_math == mathCommandDefinition.end()) {
-                return {description, argsStrings};
+        return profile(response, [&]() {
+            if (auto command = command_by_id(id)) {
+                PROFILE_COMMAND(*command);
+                return dispatch(*command, args, response, stream);
             }
-            for (auto &cmd_data : mathOP_names) {
-                if (cmd_data == "")
-                    continue;
-                if (cmd_data.rfind(command, 0) == 0) {
-                    argsStrings.push_back(it_math->name + " " + cmd_data);
-                    description.push_back("Using the command " + it_math->name + " " + cmd_data + " to modify the value of " + it_math->name);
-                }
+            if (auto staticCommand = static_command_by_id(id)) {
+                PROFILE_COMMAND(staticEntry(staticCommand));
+                PROFILE_CALLBACK();
+                response = staticCommand->callback(args, stream);
+                return true;
             }
-        }
-        return {description, argsStrings};
+            response = commandErrorMessage(ERROR_UNKNOWN_COMMAND);
+            return false;
+        });
     }
 
-    bool processCommand(const std::string &commandStr, std::string &response, Stream& stream) {
-        std::string command = commandStr;
-        for (auto&c : command) {
-            c = tolower(c);
-        }
-        std::string caseCommand = commandStr;
-        command.erase(command.find_last_not_of(" \n\r\t") + 1);
-        command.erase(0, command.find_first_of(PSTR("abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRTSUVWXYZ")));
-        const auto empty_char_pos = command.find_first_of(' ');
-        std::string name = command.substr(0, empty_char_pos);
-        if (empty_char_pos == std::string::npos) {
-            command.clear();
-            caseCommand.clear();
-        }else {
-            command.erase(0, empty_char_pos + 1);
-            caseCommand.erase(0, empty_char_pos + 1);
-        }
-        auto pos = command.find_first_not_of(" \n\r\t");
-        if (pos != 0 && pos != std::string::npos) {
-            command.erase(0, pos);
-            caseCommand.erase(0, pos);
-        }
-
-        auto it = std::find_if(commandDefinitions.begin(), commandDefinitions.end(),
-                               [&name](const Command &cmd) {
-                                   return cmd.name == name;
-                               });
-
-        if (it == commandDefinitions.end()) {
-            auto it_math = std::find_if(mathCommandDefinition.begin(), mathCommandDefinition.end(),[&name](const MathCommand& cmd){ return cmd.name == name;});
-            if (it_math == mathCommandDefinition.end()) {
-                response = PSTR("Error: Unknown command.");
-                return false;
-            }
-            auto index = command.find_last_not_of(" \n\r\t") + 1;
-            command.erase(index);
-            caseCommand.erase(index);
-            if (command.empty()) {
-                response = it_math->callback(stream, (it_math->value)->get(), MathOP::EMPTY);
-                return true;
-            }
-            const auto e_c_p = command.find_first_of(' ');
-            if (e_c_p == std::string::npos) {
-                response = PSTR("Error: Invalid math command please add value.");
+    // operands holds mathOperandCount(op) values
+    bool invokeMath(uint16_t id, MathOP op, const double *operands, std::string &response, Stream& stream) {
+        if (lineExecutor() != nullptr) {
+            auto command = math_command_by_id(id);
+            int operandCount = mathOperandCount(op);
+            if (command == nullptr || operandCount < 0) {
+                response = command == nullptr ? std::string(commandErrorMessage(ERROR_UNKNOWN_COMMAND))
+                                              : std::string(commandErrorMessage(ERROR_UNKNOWN_OPERATOR)).append(mathOperatorName(op));
                 return false;
             }
-            std::string math_command = command.substr(0, e_c_p);
-            if (e_c_p == std::string::npos) {
-                response = PSTR("Error: Invalid math command.");
+            core->submitText.assign(command->name);
+            if (op != MathOP::EMPTY) core->submitText.append(" ").append(mathOperatorName(op));
+            for (int i = 0; i < operandCount; ++i) appendDouble(operands[i], core->submitText);
+            return submitLine(core->submitText, response, stream, id);
+        }
+        return profile(response, [&]() {
+            auto found = idIndex.find(id);
+            if (found == idIndex.end() || found->second.math == CommandIndex::npos) {
+                response = commandErrorMessage(ERROR_UNKNOWN_COMMAND);
                 return false;
             }
-            command.erase(0, e_c_p + 1);
-            char *end;
-            double value = std::strtod(command.c_str(), &end);
-            if (end == command.c_str()) {
-                response = PSTR("Error: Invalid double argument.");
+            auto &command = mathCommandDefinition[found->second.math];
+            PROFILE_COMMAND(command);
+            if (mathOperandCount(op) < 0) {
+                response.assign(commandErrorMessage(ERROR_UNKNOWN_OPERATOR)).append(mathOperatorName(op));
                 return false;
             }
-            auto mathOp = stringToMathOP(math_command);
+            return applyMathOp(command, op, operands, response, stream);
+        });
+    }
 
-            switch (mathOp) {
-                case MathOP::ADD: {
-                    it_math->value->set(it_math->value->get() + value);
-                    //it_math->value += value;
-                    break;
-                }
-                case MathOP::SUB: {
-                    it_math->value->set(it_math->value->get() - value);
-                    //it_math->value -= value;
-                    break;
-                }
-                case MathOP::MUL: {
-                    it_math->value->set(it_math->value->get() * value);
-                    //it_math->value *= value;
-                    break;
-                }
-                case MathOP::DIV: {
-                    it_math->value->set(it_math->value->get() / value);
-                    //it_math->value /= value;
-                    break;
-                }
-                case MathOP::MOD: {
-                    it_math->value->set(fmod(it_math->value->get(), value));
-                    //it_math->value = fmod(it_math->value, value);
-                    break;
-                }
-                case MathOP::POW: {
-                    it_math->value->set(pow(it_math->value->get(), value));
-                    // it_math->value = pow(it_math->value, value);
-                    break;
-                }
-                case MathOP::SET: {
-                    it_math->value->set(value);
-                    // it_math->value = value;
-                    break;
-                }
-                default: {
-                    response = "Unknown operator ! " + math_command;
-                    return false;
-                }
-            }
-            response = it_math->callback(stream, it_math->value->get(), mathOp);
-            return true;
-        }
+#ifdef COMMAND_PARSER_PROFILING
+    // Snapshot of the parser wide counters, per command ones are in each definition's stats
+    [[nodiscard]] ParserStats stats() const {
+        return core->parserStats;
+    }
 
-        const std::string &argTypes = it->argTypes;
-        commandArgs.clear();
-        bool optional = false;
-        bool done = false;
-        for (char argType: argTypes) {
-            Argument arg;
-
-            if (done) {
-                arg = Argument();
-            }else {
-                switch (argType) {
-                    case 'd': {
-                        char *end;
-                        double value = std::strtod(command.c_str(), &end);
-                        if (end == command.c_str()) {
-                            response = PSTR("Error: Invalid double argument.");
-                            if (optional) {
-                                done = true;
-                                break;
-                            }
-                            return false;
-                        }
-                        arg = Argument(value);
-                        command.erase(0, end - command.c_str());
-                        caseCommand.erase(0, end - command.c_str());
-                        break;
-                    }
-                    case 'u': {
-                        uint64_t value;
-                        size_t bytesRead = strToInt<uint64_t>(command.c_str(), &value, 0,
-                                                              std::numeric_limits<uint64_t>::max());
-                        if (bytesRead == 0) {
-                            response = PSTR("Error: Invalid unsigned integer argument.");
-                            if (optional) {
-                                done = true;
-                                break;
-                            }
-                            return false;
-                        }
-                        arg = Argument(value);
-                        command.erase(0, bytesRead);
-                        caseCommand.erase(0, bytesRead);
-                        if (command.size() > 0) {
-                            command.erase(0, 1);
-                        }
-                        break;
-                    }
-                    case 'i': {
-                        int64_t value;
-                        size_t bytesRead = strToInt(command.c_str(), &value, std::numeric_limits<int64_t>::min(),
-                                                    std::numeric_limits<int64_t>::max());
-                        if (bytesRead == 0) {
-                            response = PSTR("Error: Invalid integer argument.");
-                            if (optional) {
-                                done = true;
-                                break;
-                            }
-                            return false;
-                        }
-                        arg = Argument(value);
-                        command.erase(0, bytesRead);
-                        caseCommand.erase(0, bytesRead);
-                        if (command.size() > 0) {
-                            command.erase(0, 1);
-                            caseCommand.erase(0, 1);
-                        }
-                        break;
-                    }
-                    case 's': {
-                        std::string value;
-                        size_t bytesRead = parseString(caseCommand.c_str(), value);
-                        if (bytesRead == 0) {
-                            response = PSTR("Error: Invalid string argument.");
-                            if (optional) {
-                                done = true;
-                                break;
-                            }
-                            return false;
-                        }
-                        arg = Argument(value);
-                        command.erase(0, bytesRead);
-                        caseCommand.erase(0, bytesRead);
-                        break;
-                    }
-                    case 'o': {
-                        optional = true;
-                    }
-                }
-                if (done) {
-                    arg = Argument();
-                }
-            }
-            if (argType != 'o') {
-                commandArgs.push_back(arg);
-            }
+    void reset_stats() {
+        core->parserStats = ParserStats{};
+        for (auto &command : commandDefinitions) command.stats = CommandStats{};
+        for (auto &command : mathCommandDefinition) command.stats = CommandStats{};
+        for (auto &table : staticTables) {
+            for (auto &entry : table.entries) entry.stats = CommandStats{};
         }
-        auto t_index = command.find_first_not_of(" \t");
-        command.erase(0, t_index); // Trim whitespace
-        caseCommand.erase(0, t_index);
-        if (!command.empty()) {
-            response = PSTR("Error: Too many arguments provided.");
-            return false;
+        for (auto &group : groups) group.parser->reset_stats();
+    }
+
+    // One line per command that ran (calls, errors, total parse and callback micros, slowest callback), then the
+    // parser counters, written straight to the stream since it doesn't fit a response
+    void print_stats(Stream& stream) const {
+        char line[96];
+        printCommandStats(stream, "");
+        snprintf(line, sizeof(line), "lines=%lu peak_response=%lu\r\n", static_cast<unsigned long>(core->parserStats.lines),
+                 static_cast<unsigned long>(core->parserStats.peakResponseSize));
+        stream.print(line);
+        for (size_t i = 0; i <= CommandErrorCount; ++i) {
+            if (core->parserStats.errors[i] == 0) continue;
+            snprintf(line, sizeof(line), "%s=%lu\r\n", i < CommandErrorCount ? commandError_names[i] : "OTHER",
+                     static_cast<unsigned long>(core->parserStats.errors[i]));
+            stream.print(line);
         }
+    }
 
-        response = it->callback(commandArgs, stream);
-        return true;
+private:
+    // Commands of groups are listed with their path
+    void printCommandStats(Stream& stream, const std::string &prefix) const {
+        char line[96];
+        auto print = [&stream, &line, &prefix](const char *name, const CommandStats &stats) {
+            if (stats.calls == 0) return;
+            snprintf(line, sizeof(line), "%s%s calls=%lu errors=%lu parse=%luus callback=%luus max=%luus\r\n", prefix.c_str(), name,
+                     static_cast<unsigned long>(stats.calls), static_cast<unsigned long>(stats.errors),
+                     static_cast<unsigned long>(stats.parseMicros), static_cast<unsigned long>(stats.callbackMicros),
+                     static_cast<unsigned long>(stats.maxCallbackMicros));
+            stream.print(line);
+        };
+        for_each_command([&print](const BaseCommand &command, bool) { print(command.name.c_str(), command.stats); });
+        for_each_static_command([this, &print](const StaticCommand &command, uint16_t) {
+            print(command.name, staticEntry(&command).stats);
+        });
+        for (auto &group : groups) group.parser->printCommandStats(stream, prefix + group.name + " ");
+    }
+
+public:
+
+    // The built-in stats command, "stats reset" clears the counters
+    CommandParser() {
+        registerCommand(COMMAND_PARSER_STATS_COMMAND, "os", CommandViewCallback([this](ArgumentSpan args, Stream& stream) {
+            if (args[0] && args[0].asString() == "reset") {
+                reset_stats();
+                return std::string(PSTR("Stats cleared."));
+            }
+            print_stats(stream);
+            return std::string();
+        }), PSTR("Call counts and timings per command, 'reset' clears them"));
     }
+#else
+    CommandParser() = default;
+#endif
 
-    [[nodiscard]] std::vector<Command> command_definitions() const {
+    [[nodiscard]] const std::vector<Command> &command_definitions() const {
         return commandDefinitions;
     }
+
+    [[nodiscard]] const std::vector<MathCommand> &math_command_definitions() const {
+        return mathCommandDefinition;
+    }
+
+    // Writable, for MathSnapshot, the vector itself must not be resized
+    [[nodiscard]] std::vector<MathCommand> &math_command_definitions() {
+        return mathCommandDefinition;
+    }
+
+    // Calls visitor(const BaseCommand&, bool isMath) for every registered command, standard ones first, without copying any
+    template<typename Visitor>
+    void for_each_command(Visitor &&visitor) const {
+        for (auto &command : commandDefinitions) {
+            visitor(static_cast<const BaseCommand &>(command), false);
+        }
+        for (auto &command : mathCommandDefinition) {
+            visitor(static_cast<const BaseCommand &>(command), true);
+        }
+    }
+
+    // Calls visitor(const StaticCommand&, uint16_t id) for every command of the registered static tables
+    template<typename Visitor>
+    void for_each_static_command(Visitor &&visitor) const {
+        for (auto &table : staticTables) {
+            for (size_t i = 0; i < table.count; ++i) {
+                visitor(table.commands[i], static_cast<uint16_t>(table.firstId + i));
+            }
+        }
+    }
 };
 
-inline void clearline(Stream& stream, const TerminalIdentifier& identifier) {
-    if(identifier.type == TERMINAL_END_LINE_WITH_CARRIAGE_RETURN || identifier.type == TERMINAL_END_LINE_WITH_LINE_FEED){
-        stream.print("\r");
-        std::string str(80, ' ');
-        stream.print(str.c_str());
-        stream.print("\r");
-    }else{
-        stream.print("\r");
-        std::string str(80, ' ');
-        stream.print(str.c_str());
-        stream.print("\r");
-        //stream.println();
+// Carriage return then ANSI erase-line, the same on every terminal type
+inline void clearline(Stream& stream, const TerminalIdentifier&) {
+    stream.print("\r\x1b[2K");
+}
+
+// Moves the terminal cursor by columns, negative to the left, in one sequence whatever the distance
+inline void cursorMove(Stream& stream, int columns) {
+    if (columns == 0) return;
+    if (columns == -1) {
+        stream.write('\b');
+        return;
     }
+    char sequence[16];
+    snprintf(sequence, sizeof(sequence), "\x1b[%d%c", columns < 0 ? -columns : columns, columns < 0 ? 'D' : 'C');
+    stream.print(sequence);
+}
 
+// ANSI ICH, opens a blank at the cursor by shifting the rest of the line right
+inline void insertChar(Stream& stream) {
+    stream.print("\x1b[@");
 }
 
-inline std::string longestCommonPrefix(const std::vector<std::string> &strs) {
-    if (strs.empty()) return "";
+// ANSI DCH, removes the character under the cursor, the rest of the line shifts left
+inline void deleteChar(Stream& stream) {
+    stream.print("\x1b[P");
+}
 
-    // Start by assuming the whole first string is the prefix
-    std::string prefix = strs[0];
+// Limits for one call of CommandLineHandler::handle_commandline, 0 means no limit.
+// The check happens between bytes, a callback that is already running is never interrupted.
+struct CommandLineBudget {
+    unsigned long maxMicros = 0;
+    size_t maxBytes = 0;
+    size_t maxCommands = 0;
+};
 
-    for (size_t i = 1; i < strs.size(); ++i) {
-        // Compare prefix with each string
-        size_t j = 0;
-        while (j < prefix.size() && j < strs[i].size() && prefix[j] == strs[i][j]) {
-            ++j;
-        }
-        prefix = prefix.substr(0, j);
+// One terminal of a CommandLineHandler shared by several (see CommandLineMultiplexer): what it keeps between its turns,
+// the line being typed, the escape sequence half received, a streaming command still writing. History and buffers
+// stay with the handler. It is also the stream its commands, results and watches are tied to, its writes go through
+// the handler's buffer while it is served and straight to its link otherwise.
+class CommandLineSession : public Stream {
+    friend class CommandLineHandler;
+    friend class CommandLineMultiplexer;
+
+    Stream *link = nullptr;
+    BufferedStream *output = nullptr;
+    std::string line;
+    size_t cursor = 0;
+    StateMachine escape;
+    TerminalIdentifier id;
+    CommandParser::CommandGenerator generator;
+    bool echo = true;
+    bool backpressure = true;
+    int txRoom = 0;
+    std::string watchLine;
+    // Only used during a Ctrl-R search
+    bool searching = false;
+    bool searchFailed = false;
+    std::string searchText;
+    std::string savedLine;
 
-        if (prefix.empty()) break; // early exit if no common prefix
+public:
+    using Print::write;
+
+    int available() override { return link->available(); }
+
+    int read() override { return link->read(); }
+
+    int peek() override { return link->peek(); }
+
+    size_t write(uint8_t c) override { return output != nullptr ? output->write(c) : link->write(c); }
+
+    size_t write(const uint8_t *data, size_t size) override {
+        return output != nullptr ? output->write(data, size) : link->write(data, size);
     }
 
-    return prefix;
-}
+    int availableForWrite() override { return output != nullptr ? output->availableForWrite() : link->availableForWrite(); }
 
+    void flush() override {
+        if (output != nullptr) output->flush();
+        else link->flush();
+    }
+
+    // Same as CommandLineHandler::setEcho and setBackpressure, for this terminal only
+    void setEcho(bool enabled) {
+        echo = enabled;
+    }
 
+    void setBackpressure(bool enabled) {
+        backpressure = enabled;
+    }
+};
 
 class CommandLineHandler {
+    friend class CommandLineMultiplexer;
+
     std::string cmd;
     std::string response;
-    RoundArray array;
+    std::string completion;
+    HistoryRing history;
+    // Ctrl-R state, cmd holds the current match and savedLine what was typed before the search
+    bool searching = false;
+    bool searchFailed = false;
+    std::string searchText;
+    std::string savedLine;
+    // Line taken from a line queue
+    std::string queued;
     StateMachine stateMachine;
     TerminalIdentifier id;
     CommandParser& parser;
-    Stream& stream;
+    // Everything, command output included, goes through the buffer so it stays in order
+    BufferedStream stream;
+    // What commands, results and watches are tied to: the buffer, or the session being served
+    Stream *io = &stream;
     size_t cursor = 0;
+    bool echo = true;
+    // Streaming command still writing, input waits in the stream until it is done
+    CommandParser::CommandGenerator generator;
+    bool backpressure = true;
+    // Due watched values, sent as a single line
+    std::string watchLine;
+    // Most availableForWrite has answered, the size of the TX buffer as far as the handler can tell
+    int txRoom = 0;
 
 public:
+    // Without echo, typed characters and line redraws are not sent back, only command output is
+    void setEcho(bool enabled) {
+        echo = enabled;
+    }
+
+    // With backpressure a streaming command only gets what the TX buffer takes without blocking. Turn it off for
+    // streams whose availableForWrite is not implemented and always answers 0.
+    void setBackpressure(bool enabled) {
+        backpressure = enabled;
+    }
+
+    // parser.watch() for this terminal. Its values are polled with the handler's buffered stream, not the one it
+    // wraps, so watching Serial through the parser directly would never print.
+    bool watch(std::string_view name, uint32_t periodMs, bool onlyChanged = false) {
+        return parser.watch(*io, name, periodMs, onlyChanged);
+    }
+
+    bool unwatch(std::string_view name) {
+        return parser.unwatch(*io, name);
+    }
+
+    // Runs a whole script at once (see CommandParser::processBatch) and writes all the responses in a single write
+    size_t process_batch(std::string_view batch) {
+        response.clear();
+        size_t failures = parser.processBatch(batch, response, *io);
+        if (!response.empty()) {
+            stream.write(response.data(), response.size());
+        }
+        stream.flush();
+        return failures;
+    }
+
     void setCommand(const std::string& a){
         if (a != "") {
-            clearline(stream, id);
             cmd = a;
             cursor = cmd.size();
-            stream.print(a.c_str());
+            if (echo) {
+                clearline(stream, id);
+                stream.print(a.c_str());
+            }
         }
     }
 
-    CommandLineHandler(CommandParser& parser, Stream& stream): parser(parser), stream(stream) {
-        stateMachine.set(UP_LAST_CHAR, [&]{
-            setCommand(array.go_up());
-        });
-        stateMachine.set(DOWN_LAST_CHAR, [&]{
-            setCommand(array.go_down());
-        });
-        stateMachine.set(LEFT_LAST_CHAR, [&]{
-            if (cursor > 0) {
-                stream.write('\b');  // move cursor left
-                cursor--;
-            }
-        });
-        stateMachine.set(RIGHT_LAST_CHAR, [&]{
-            if (cursor < cmd.length()) {
-                stream.write(cmd[cursor]);  // reprint character under cursor
-                cursor++;
+    // Runs complete lines from a queue (see MpscLineQueue), at most maxLines of them when not 0, each printed with its
+    // response as if it had been typed. The line being typed stays as it is. Returns the number of lines run.
+    template<typename Queue>
+    size_t handle_lines(Queue &queue, size_t maxLines = 0) {
+        size_t lines = 0;
+        while ((maxLines == 0 || lines < maxLines) && queue.pop(queued)) {
+            if (echo) {
+                clearline(stream, id);
+                stream.println(queued.c_str());
             }
-        });
+            parser.processCommand(queued, response, *io);
+            if (!response.empty()) stream.println(response.c_str());
+            history.add(queued);
+            lines++;
+        }
+        if (lines != 0 && echo) {
+            stream.print(cmd.c_str());
+            cursorMove(stream, static_cast<int>(cursor) - static_cast<int>(cmd.size()));
+        }
+        printFinished();
+        stream.flush();
+        return lines;
+    }
 
+    // The line, completion and response buffers and the history ring are allocated here, see COMMAND_PARSER_FIXED_MEMORY
+    CommandLineHandler(CommandParser& parser, Stream& stream, size_t lineSize = MAX_COMMAND_LINE_SIZE, size_t historyBytes = COMMAND_HISTORY_BYTES)
+        : history(historyBytes), parser(parser), stream(stream) {
+        cmd.reserve(lineSize);
+        completion.reserve(lineSize);
+        searchText.reserve(lineSize);
+        savedLine.reserve(lineSize);
+        queued.reserve(lineSize);
+        response.reserve(MAX_RESPONSE_SIZE);
     }
     void handle_commandline() {
+        handle_commandline(CommandLineBudget{});
+    }
+
+private:
+    // One turn of the streaming command, at most RESPONSE_CHUNK_SIZE bytes
+    void resumeGenerator() {
+        stream.flush();
+        size_t room = RESPONSE_CHUNK_SIZE;
+        if (backpressure) {
+            int writable = stream.wrapped().availableForWrite();
+            room = std::min(room, static_cast<size_t>(std::max(writable, 0)));
+        }
+        if (room == 0) return;
+        ResponseWriter out(stream, room);
+        if (generator(out)) generator = nullptr;
+        stream.flush();
+    }
+
+    // Results of asynchronous commands started from this terminal, printed above the line being typed
+    void printFinished() {
+        if (!parser.take_finished(*io, response)) return;
+        if (echo) clearline(stream, id);
+        do {
+            if (!response.empty()) stream.println(response.c_str());
+        } while (parser.take_finished(*io, response));
+        redrawLine();
+    }
+
+    // Watched values due this turn as one "name=value name=value" line, also above the line being typed. With
+    // backpressure the line waits for a TX buffer taking it whole, or as empty as it has been seen for a longer one,
+    // and no new values are polled meanwhile.
+    void printWatches() {
+        if (watchLine.empty()) {
+            char value[32];
+            parser.poll_watches(*io, micros(), [this, &value](const CommandParser::MathCommand &command, std::string_view path) {
+                command.value.format(value, sizeof(value));
+                if (!watchLine.empty()) watchLine += ' ';
+                watchLine.append(path.data(), path.size()).append("=").append(value);
+            });
+            if (watchLine.empty()) return;
+        }
+        if (backpressure) {
+            stream.flush();
+            int writable = stream.wrapped().availableForWrite();
+            txRoom = std::max(txRoom, writable);
+            if (writable < static_cast<int>(std::min(watchLine.size() + 2, static_cast<size_t>(txRoom)))) return;
+        }
+        if (echo) clearline(stream, id);
+        stream.println(watchLine.c_str());
+        watchLine.clear();
+        redrawLine();
+    }
+
+    void redrawLine() {
+        if (echo) {
+            stream.print(cmd.c_str());
+            cursorMove(stream, static_cast<int>(cursor) - static_cast<int>(cmd.size()));
+        }
+        stream.flush();
+    }
+
+    void handleKey(EscapeKey key, uint8_t modifier) {
+        switch (key) {
+            // The history copies straight into the line, setCommand then only redraws it
+            case EscapeKey::UP:
+                if (history.go_up(cmd)) setCommand(cmd);
+                break;
+            case EscapeKey::DOWN:
+                if (history.go_down(cmd)) setCommand(cmd);
+                break;
+            // With a modifier (ESC [ 1 ; 5 D for ctrl) the arrows jump by words
+            case EscapeKey::LEFT:
+                if (modifier > 1) moveCursorTo(previousWord());
+                else if (cursor > 0) moveCursorTo(cursor - 1);
+                break;
+            case EscapeKey::RIGHT:
+                if (modifier > 1) moveCursorTo(nextWord());
+                else moveCursorTo(cursor + 1);
+                break;
+            case EscapeKey::HOME:
+                moveCursorTo(0);
+                break;
+            case EscapeKey::END:
+                moveCursorTo(cmd.size());
+                break;
+            case EscapeKey::DELETE:
+                eraseAtCursor();
+                break;
+            default:
+                break;
+        }
+    }
+
+    // Line editing, every edit sends a few bytes whatever the length of the line
+    void insertAtCursor(char c) {
+        cmd.insert(cmd.begin() + cursor, c);
+        if (echo) {
+            if (cursor + 1 != cmd.size()) insertChar(stream);
+            stream.write(c);
+        }
+        cursor++;
+    }
+
+    void eraseBeforeCursor() {
+        if (cursor == 0) return;
+        cmd.erase(cursor - 1, 1);
+        cursor--;
+        if (echo) {
+            stream.write('\b');
+            deleteChar(stream);
+        }
+    }
+
+    void eraseAtCursor() {
+        if (cursor >= cmd.size()) return;
+        cmd.erase(cursor, 1);
+        if (echo) deleteChar(stream);
+    }
+
+    void moveCursorTo(size_t position) {
+        position = std::min(position, cmd.size());
+        if (echo) {
+            // Reprinting the character under the cursor is shorter than a sequence
+            if (position == cursor + 1) stream.write(cmd[cursor]);
+            else cursorMove(stream, static_cast<int>(position) - static_cast<int>(cursor));
+        }
+        cursor = position;
+    }
+
+    // Start of the word before the cursor and end of the one after it, like readline
+    size_t previousWord() const {
+        size_t position = cursor;
+        while (position > 0 && cmd[position - 1] == ' ') position--;
+        while (position > 0 && cmd[position - 1] != ' ') position--;
+        return position;
+    }
+
+    size_t nextWord() const {
+        size_t position = cursor;
+        while (position < cmd.size() && cmd[position] == ' ') position++;
+        while (position < cmd.size() && cmd[position] != ' ') position++;
+        return position;
+    }
+
+    void drawSearch() {
+        if (!echo) return;
+        clearline(stream, id);
+        stream.print(searchFailed ? "(failed reverse-i-search)`" : "(reverse-i-search)`");
+        stream.write(searchText.data(), searchText.size());
+        stream.print("': ");
+        stream.write(cmd.data(), cmd.size());
+    }
+
+    void endSearch() {
+        searching = false;
+        cursor = cmd.size();
+        if (echo) {
+            clearline(stream, id);
+            stream.write(cmd.data(), cmd.size());
+        }
+    }
+
+    // Ctrl-R walks to older matches, typed characters and backspace refine the search, Ctrl-G puts the line back.
+    // Anything else keeps the match as the line and is then handled as usual, so Enter runs it.
+    // Returns true when the character was consumed by the search.
+    bool handleSearch(char c) {
+        if (c == TERMINAL_REVERSE_SEARCH) {
+            searchFailed = !history.search(searchText, true, cmd) && !searchText.empty();
+            drawSearch();
+            return true;
+        }
+        if (c == TERMINAL_CANCEL) {
+            cmd = savedLine;
+            history.goto_last();
+            endSearch();
+            return true;
+        }
+        if (c == 8 || c == 127 || (c >= 32 && c < 127)) {
+            if (c == 8 || c == 127) {
+                if (!searchText.empty()) searchText.pop_back();
+                // A shorter needle matches at least what the longer one did, start again from the newest entry
+                history.goto_last();
+            } else {
+#ifdef COMMAND_PARSER_FIXED_MEMORY
+                if (searchText.size() >= searchText.capacity()) return true;
+#endif
+                searchText += c;
+            }
+            searchFailed = !history.search(searchText, false, cmd);
+            drawSearch();
+            return true;
+        }
+        endSearch();
+        return false;
+    }
 
+public:
 
+    // Returns early once the budget is used, the partial line and escape state are kept for the next call.
+    // Returns the number of bytes still waiting in the stream. Finished asynchronous commands are printed on every call,
+    // input or not.
+    size_t handle_commandline(const CommandLineBudget& budget) {
+        printFinished();
+        if (generator) {
+            resumeGenerator();
+            if (generator) return pendingBytes();
+        }
+        printWatches();
+        unsigned long start = micros();
+        size_t bytes = 0;
+        size_t commands = 0;
         while (stream.available()) {
+            if ((budget.maxBytes != 0 && bytes >= budget.maxBytes) ||
+                (budget.maxCommands != 0 && commands >= budget.maxCommands) ||
+                (budget.maxMicros != 0 && micros() - start >= budget.maxMicros)) {
+                break;
+            }
+            bytes++;
             char c = stream.read();
+            if (searching && handleSearch(c)) {
+                continue;
+            }
+            if (c == TERMINAL_REVERSE_SEARCH) {
+                searching = true;
+                searchFailed = false;
+                searchText.clear();
+                savedLine = cmd;
+                history.goto_last();
+                drawSearch();
+                continue;
+            }
             if (c == 27) {
                 stateMachine.begin();
                 continue;
             }
             if (stateMachine.isStarted()) {
-                auto result = stateMachine.append(c);
-                if (result.empty())
+                EscapeKey key = stateMachine.append(c);
+                if (key != EscapeKey::REJECTED) {
+                    if (key != EscapeKey::PENDING) handleKey(key, stateMachine.modifier());
                     continue;
-                for (auto a: result) {
+                }
+                for (auto a: stateMachine.rejected()) {
                     stream.print((char) a);
                 }
             }
-            if (c == 8) {
-                if (!cmd.empty() && cursor > 0) {
-                    cmd.erase(cmd.begin() + cursor - 1);
-                    cursor--;
-                    clearline(stream, id);
-                    stream.print(cmd.c_str());
-                    for (size_t i = cmd.size(); i > cursor; --i)
-                        stream.write('\b');
-                }
+            if (c == 8 || c == 127) {
+                eraseBeforeCursor();
             } else if (c == 9) {
                 auto index = cmd.find_first_not_of(" \n\r\t");
                 cmd = cmd.erase(0, index);
-                auto [descriptions, commandNames]= parser.tab_complete(cmd);
-                if (commandNames.empty()) {
-                } else {
-                    if (commandNames.size() == 1) {
-                        clearline(stream, id);
-                        stream.print((commandNames.front() + " : " + descriptions.front() + "\n").c_str());
-                        cmd = commandNames.front();
-                        cursor = cmd.size();
-                        stream.print(cmd.c_str());
-                    } else {
-                        stream.println();
-                        for (size_t i = 0; i < commandNames.size(); i++) {
-                            stream.println((commandNames[i] + ": " + (descriptions[i].empty() ? "No description found" : descriptions[i])).c_str());
+                size_t count = parser.complete(cmd, completion);
+                if (count == 1) {
+                    clearline(stream, id);
+                    parser.complete(cmd, completion, [this](std::string_view name, std::string_view description) {
+                        stream.write(name.data(), name.size());
+                        stream.print(" : ");
+                        stream.write(description.data(), description.size());
+                        stream.print("\n");
+                    });
+                } else if (count > 1) {
+                    stream.println();
+                    parser.complete(cmd, completion, [this](std::string_view name, std::string_view description) {
+                        stream.write(name.data(), name.size());
+                        stream.print(": ");
+                        if (description.empty()) {
+                            stream.println("No description found");
+                        } else {
+                            stream.write(description.data(), description.size());
+                            stream.println();
                         }
-                        cmd = longestCommonPrefix(commandNames);
-                        cursor = cmd.size();
-                        stream.print(cmd.c_str());
-                    }
+                    });
+                }
+                if (count != 0) {
+#ifdef COMMAND_PARSER_FIXED_MEMORY
+                    if (completion.size() > cmd.capacity()) completion.resize(cmd.capacity());
+#endif
+                    cmd = completion;
+                    cursor = cmd.size();
+                    stream.print(cmd.c_str());
                 }
             } else {
                 if(id.identifying){
@@ -715,30 +3550,19 @@ public:
                     id.identified = true;
                     id.identifying = false;
                 }
-                if (cursor == cmd.size()) {
-                    if (std::string(1, c).find_first_of("\t\r\n") == std::string::npos) {
-                        cmd += c;
-                        stream.write(c);
-                        cursor++;
-                    }
-                } else {
-                    if (std::string(1, c).find_first_of("\t\r\n") == std::string::npos) {
-                        cmd.insert(cmd.begin() + cursor, c);
-                        clearline(stream, id);
-                        stream.print(cmd.c_str());
-                        // Move cursor back to correct position
-                        for (size_t i = cmd.size(); i > cursor + 1; --i)
-                            stream.write('\b');
-
-                        cursor++;
-
-                    }
+                bool printable = c != '\t' && c != '\r' && c != '\n';
+#ifdef COMMAND_PARSER_FIXED_MEMORY
+                // The line never grows past what the constructor reserved
+                if (cmd.size() >= cmd.capacity()) printable = false;
+#endif
+                if (printable) {
+                    insertAtCursor(c);
                 }
             }
 
 
             if ((c == '\r' && !id.identified) || (c == '\r' && id.type == TERMINAL_END_LINE_WITH_CARRIAGE_RETURN) || (c== '\n' && (id.type == TERMINAL_END_LINE_WITH_LINE_FEED || id.type == TERMINAL_END_LINE_WITH_BOTH))) {
-                if((c=='\r' && TERMINAL_END_LINE_WITH_CARRIAGE_RETURN) || (c=='\n' && TERMINAL_END_LINE_WITH_LINE_FEED)) {
+                if(echo && ((c=='\r' && TERMINAL_END_LINE_WITH_CARRIAGE_RETURN) || (c=='\n' && TERMINAL_END_LINE_WITH_LINE_FEED))) {
                     clearline(stream, id);
                     stream.print(cmd.c_str());
                     cursor = cmd.size();
@@ -749,17 +3573,66 @@ public:
                 if(!id.identified){
                     id.identifying = true;
                 }
-                parser.processCommand(cmd, response, stream);
-                array.add(cmd);
-                array.goto_last();
-                cmd = "";
+                parser.processCommand(cmd, response, *io, generator);
+#ifdef COMMAND_PARSER_FIXED_MEMORY
+                if (response.size() > MAX_RESPONSE_SIZE) response.resize(MAX_RESPONSE_SIZE);
+#endif
+                commands++;
+                history.add(cmd);
+                cmd.clear();
                 cursor = 0;
-                if (!response.empty() && response != "") {
+                if (!response.empty()) {
                     stream.println(response.c_str());
                 }
+                // A command that finished within its own callback prints right after its line
+                printFinished();
+                stream.flush();
+                if (generator) {
+                    resumeGenerator();
+                    if (generator) break;
+                }
             }
-            stream.flush();
         }
+        stream.flush();
+        return pendingBytes();
+    }
+
+private:
+    // Serves session until detach, its state takes the place of the handler's own
+    void attach(CommandLineSession &session) {
+        stream.retarget(*session.link);
+        swapState(session);
+        session.output = &stream;
+        io = &session;
+    }
+
+    void detach(CommandLineSession &session) {
+        stream.flush();
+        session.output = nullptr;
+        swapState(session);
+        io = &stream;
+    }
+
+    // Strings and the generator only trade their buffers, nothing is copied
+    void swapState(CommandLineSession &session) {
+        std::swap(cmd, session.line);
+        std::swap(cursor, session.cursor);
+        std::swap(stateMachine, session.escape);
+        std::swap(id, session.id);
+        std::swap(generator, session.generator);
+        std::swap(echo, session.echo);
+        std::swap(backpressure, session.backpressure);
+        std::swap(txRoom, session.txRoom);
+        std::swap(watchLine, session.watchLine);
+        std::swap(searching, session.searching);
+        std::swap(searchFailed, session.searchFailed);
+        std::swap(searchText, session.searchText);
+        std::swap(savedLine, session.savedLine);
+    }
+
+    size_t pendingBytes() {
+        int backlog = stream.available();
+        return backlog > 0 ? static_cast<size_t>(backlog) : 0;
     }
 };
 
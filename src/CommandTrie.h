@@ -0,0 +1,174 @@
+//
+// Created by fogoz on 14/10/2026.
+//
+
+#ifndef PAMITEENSY_COMMANDTRIE_H
+#define PAMITEENSY_COMMANDTRIE_H
+#include "string"
+#include "string_view"
+#include "vector"
+#include "cstdint"
+
+// Radix tree over the registered names, kept up to date by the parser so completion never walks the whole registry
+class CommandTrie {
+public:
+    static constexpr uint8_t COMMAND = 1;
+    static constexpr uint8_t MATH = 2;
+    static constexpr uint8_t GROUP = 4;
+
+private:
+    struct Node {
+        std::string label;
+        uint8_t kinds = 0;
+        std::vector<Node> children;
+    };
+
+    Node root;
+    std::string path;
+
+    static size_t sharedLength(std::string_view a, std::string_view b) {
+        size_t i = 0;
+        while (i < a.size() && i < b.size() && a[i] == b[i]) ++i;
+        return i;
+    }
+
+    static Node *childStartingWith(Node &node, char c) {
+        for (auto &child : node.children) {
+            if (child.label[0] == c) return &child;
+        }
+        return nullptr;
+    }
+
+    // Node whose subtree holds every name starting with prefix, consumed is set to the part of the prefix matched above it
+    Node *findPrefix(std::string_view prefix, size_t &consumed) {
+        Node *node = &root;
+        consumed = 0;
+        while (consumed < prefix.size()) {
+            Node *child = childStartingWith(*node, prefix[consumed]);
+            if (child == nullptr) return nullptr;
+            size_t shared = sharedLength(child->label, prefix.substr(consumed));
+            if (consumed + shared == prefix.size()) return child;
+            if (shared < child->label.size()) return nullptr;
+            consumed += shared;
+            node = child;
+        }
+        return node;
+    }
+
+    // A name registered as several kinds counts once per kind, it is offered once per kind too
+    static size_t kindCount(uint8_t kinds) {
+        return ((kinds & COMMAND) != 0) + ((kinds & MATH) != 0) + ((kinds & GROUP) != 0);
+    }
+
+    template<typename Visitor>
+    size_t visit(const Node &node, Visitor &visitor) {
+        size_t count = 0;
+        size_t length = path.size();
+        path += node.label;
+        if (node.kinds != 0) {
+            visitor(std::string_view(path), node.kinds);
+            count += kindCount(node.kinds);
+        }
+        for (auto &child : node.children) {
+            count += visit(child, visitor);
+        }
+        path.resize(length);
+        return count;
+    }
+
+    static size_t countNames(const Node &node, uint8_t &kinds) {
+        size_t count = kindCount(node.kinds);
+        if (node.kinds != 0) kinds = node.kinds;
+        for (auto &child : node.children) {
+            count += countNames(child, kinds);
+        }
+        return count;
+    }
+
+    static bool erase(Node &node, std::string_view name, uint8_t kind) {
+        if (name.empty()) {
+            node.kinds &= ~kind;
+            return true;
+        }
+        Node *child = childStartingWith(node, name[0]);
+        if (child == nullptr || name.substr(0, child->label.size()) != child->label) return false;
+        if (!erase(*child, name.substr(child->label.size()), kind)) return false;
+        if (child->kinds == 0 && child->children.empty()) {
+            node.children.erase(node.children.begin() + (child - node.children.data()));
+        } else if (child->kinds == 0 && child->children.size() == 1) {
+            Node merged = std::move(child->children.front());
+            merged.label = child->label + merged.label;
+            *child = std::move(merged);
+        }
+        return true;
+    }
+
+public:
+    void insert(std::string_view name, uint8_t kind) {
+        if (name.empty()) return;
+        Node *node = &root;
+        while (!name.empty()) {
+            Node *child = childStartingWith(*node, name[0]);
+            if (child == nullptr) {
+                node->children.push_back(Node{std::string(name), kind, {}});
+                return;
+            }
+            size_t shared = sharedLength(child->label, name);
+            if (shared < child->label.size()) {
+                // Split the edge, the existing node keeps the tail of its label
+                Node tail{child->label.substr(shared), child->kinds, std::move(child->children)};
+                child->label.resize(shared);
+                child->kinds = 0;
+                child->children.clear();
+                child->children.push_back(std::move(tail));
+            }
+            name.remove_prefix(shared);
+            node = child;
+        }
+        node->kinds |= kind;
+    }
+
+    void remove(std::string_view name, uint8_t kind) {
+        erase(root, name, kind);
+    }
+
+    void clear() {
+        root.children.clear();
+    }
+
+    // Calls visitor(name, kinds) for every name starting with prefix, in insertion order per level, returns how many
+    // candidates that is
+    template<typename Visitor>
+    size_t for_each_match(std::string_view prefix, Visitor &&visitor) {
+        size_t consumed;
+        Node *node = findPrefix(prefix, consumed);
+        if (node == nullptr) return 0;
+        path.assign(prefix.data(), consumed);
+        if (node == &root) {
+            size_t count = 0;
+            for (auto &child : root.children) count += visit(child, visitor);
+            return count;
+        }
+        return visit(*node, visitor);
+    }
+
+    // Longest string shared by every name starting with prefix, returns how many candidates that is (a name counted
+    // once per kind) and the kinds of the only match
+    size_t common_prefix(std::string_view prefix, std::string &out, uint8_t &kinds) {
+        size_t consumed;
+        Node *node = findPrefix(prefix, consumed);
+        out.clear();
+        kinds = 0;
+        if (node == nullptr) return 0;
+        out.assign(prefix.data(), consumed);
+        if (node != &root) out += node->label;
+        size_t count = countNames(*node, kinds);
+        while (node->kinds == 0 && node->children.size() == 1) {
+            node = &node->children.front();
+            out += node->label;
+        }
+        if (count != 1) kinds = 0;
+        return count;
+    }
+};
+#endif //PAMITEENSY_COMMANDTRIE_H
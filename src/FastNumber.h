@@ -0,0 +1,215 @@
+//
+// Created by fogoz on 14/10/2026.
+//
+
+#ifndef PAMITEENSY_FASTNUMBER_H
+#define PAMITEENSY_FASTNUMBER_H
+#include "cstdint"
+#include "cstdlib"
+#include "cstring"
+#include "limits"
+#include "type_traits"
+
+// parse_float<float> computes in double where double arithmetic is in hardware, one rounding then a checked
+// narrowing. Single precision FPUs (Cortex-M4F...) keep to float operations and hand what one of them can't round
+// exactly to strtof.
+#ifndef FAST_NUMBER_FLOAT_IN_DOUBLE
+#if defined(__ARM_FP) && !(__ARM_FP & 8)
+#define FAST_NUMBER_FLOAT_IN_DOUBLE 0
+#else
+#define FAST_NUMBER_FLOAT_IN_DOUBLE 1
+#endif
+#endif
+
+// from_chars style number parsers working on [first, last): they return the pointer past the number, or first when
+// nothing valid was read, in which case value is left untouched. No locale aware ctype call, no null terminator needed.
+
+struct DigitTable {
+    uint8_t value[256];
+};
+
+// Value of every character as a digit, 0xFF for characters that are not digits in any base up to 16
+constexpr DigitTable makeDigitTable() {
+    DigitTable table{};
+    for (auto &digit : table.value) digit = 0xFF;
+    for (int c = '0'; c <= '9'; ++c) table.value[c] = static_cast<uint8_t>(c - '0');
+    for (int c = 'a'; c <= 'f'; ++c) table.value[c] = static_cast<uint8_t>(c - 'a' + 10);
+    for (int c = 'A'; c <= 'F'; ++c) table.value[c] = static_cast<uint8_t>(c - 'A' + 10);
+    return table;
+}
+
+inline constexpr DigitTable digit_table = makeDigitTable();
+
+// Decimal, 0x hexadecimal, 0o octal and 0b binary, with a sign when min_value is negative
+template<typename T>
+const char *parse_integer(const char *first, const char *last, T &value,
+                          T min_value = std::numeric_limits<T>::min(), T max_value = std::numeric_limits<T>::max()) {
+    static_assert(std::is_integral_v<T> && !std::is_same_v<T, bool>, "parse_integer needs an integer type");
+    using U = std::make_unsigned_t<T>;
+    const char *position = first;
+    bool negative = false;
+    if (min_value < 0 && position != last && (*position == '+' || *position == '-')) {
+        negative = (*position == '-');
+        position++;
+    }
+
+    U base = 10;
+    if (last - position >= 2 && position[0] == '0') {
+        char prefix = position[1] | 0x20;
+        base = prefix == 'x' ? 16 : prefix == 'o' ? 8 : prefix == 'b' ? 2 : 10;
+        if (base != 10) position += 2;
+    }
+
+    const char *digits = position;
+    U result = 0;
+    while (position != last) {
+        U digit = digit_table.value[static_cast<uint8_t>(*position)];
+        if (digit >= base) break;
+        if (__builtin_mul_overflow(result, base, &result) || __builtin_add_overflow(result, digit, &result)) return first;
+        position++;
+    }
+    if (position == digits) return first;
+
+    T parsed;
+    if (negative) {
+        // Magnitude of min_value, computed in U so the most negative value of T still fits
+        U limit = static_cast<U>(0) - static_cast<U>(min_value);
+        if (result > limit) return first;
+        parsed = static_cast<T>(static_cast<U>(0) - result);
+        if (parsed > max_value) return first;
+    } else {
+        if (max_value < 0 || result > static_cast<U>(max_value)) return first;
+        parsed = static_cast<T>(result);
+        if (parsed < min_value) return first;
+    }
+    value = parsed;
+    return position;
+}
+
+inline constexpr double exact_double_powers_of_ten[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20,
+    1e21, 1e22
+};
+
+inline constexpr float exact_float_powers_of_ten[] = {
+    1e0f, 1e1f, 1e2f, 1e3f, 1e4f, 1e5f, 1e6f, 1e7f, 1e8f, 1e9f, 1e10f
+};
+
+// The C library, on a bounded copy, for what the fast path can't do exactly. A number running up to the end of a
+// truncated copy may go on past it, it is refused rather than read as a different value.
+template<typename T>
+const char *parse_float_fallback(const char *first, const char *last, T &value) {
+    char buffer[64];
+    size_t size = static_cast<size_t>(last - first) < sizeof(buffer) - 1 ? static_cast<size_t>(last - first) : sizeof(buffer) - 1;
+    memcpy(buffer, first, size);
+    buffer[size] = '\0';
+    char *end;
+    T parsed;
+    if constexpr (std::is_same_v<T, float>) parsed = std::strtof(buffer, &end);
+    else parsed = std::strtod(buffer, &end);
+    if (end == buffer) return first;
+    if (end == buffer + size && size < static_cast<size_t>(last - first)) return first;
+    value = parsed;
+    return first + (end - buffer);
+}
+
+// Decimal floating point, [sign] digits [. digits] [e [sign] digits]. Results are correctly rounded, the cases the fast
+// path can't round exactly go to strtod/strtof (see FAST_NUMBER_FLOAT_IN_DOUBLE for float). inf, nan and hex floats
+// are handed to them as well.
+template<typename T>
+const char *parse_float(const char *first, const char *last, T &value) {
+    static_assert(std::is_same_v<T, float> || std::is_same_v<T, double>, "parse_float needs float or double");
+    const char *position = first;
+    bool negative = false;
+    if (position != last && (*position == '+' || *position == '-')) {
+        negative = (*position == '-');
+        position++;
+    }
+    if (position == last) return first;
+    bool startsNumber = static_cast<uint8_t>(*position - '0') < 10 || *position == '.';
+    bool hex = last - position >= 2 && position[0] == '0' && (position[1] | 0x20) == 'x';
+    if (!startsNumber || hex) return parse_float_fallback(first, last, value);
+
+    uint64_t mantissa = 0;
+    int digits = 0;
+    int exponent = 0;
+    bool truncated = false;
+    bool any = false;
+    while (position != last && static_cast<uint8_t>(*position - '0') < 10) {
+        uint8_t digit = static_cast<uint8_t>(*position - '0');
+        any = true;
+        if (digits < 19) {
+            mantissa = mantissa * 10 + digit;
+            if (mantissa != 0) digits++;
+        } else {
+            exponent++;
+            truncated |= digit != 0;
+        }
+        position++;
+    }
+    if (position != last && *position == '.') {
+        position++;
+        while (position != last && static_cast<uint8_t>(*position - '0') < 10) {
+            uint8_t digit = static_cast<uint8_t>(*position - '0');
+            any = true;
+            if (digits < 19) {
+                mantissa = mantissa * 10 + digit;
+                if (mantissa != 0) digits++;
+                exponent--;
+            } else {
+                truncated |= digit != 0;
+            }
+            position++;
+        }
+    }
+    if (!any) return first;
+
+    // The exponent only counts when at least one digit follows the e, like strtod
+    if (position != last && (*position | 0x20) == 'e') {
+        const char *exponentPosition = position + 1;
+        bool negativeExponent = false;
+        if (exponentPosition != last && (*exponentPosition == '+' || *exponentPosition == '-')) {
+            negativeExponent = (*exponentPosition == '-');
+            exponentPosition++;
+        }
+        if (exponentPosition != last && static_cast<uint8_t>(*exponentPosition - '0') < 10) {
+            int written = 0;
+            while (exponentPosition != last && static_cast<uint8_t>(*exponentPosition - '0') < 10) {
+                if (written < 10000) written = written * 10 + (*exponentPosition - '0');
+                exponentPosition++;
+            }
+            exponent += negativeExponent ? -written : written;
+            position = exponentPosition;
+        }
+    }
+
+    if (mantissa == 0) {
+        value = negative ? -T(0) : T(0);
+        return position;
+    }
+    // Only the whole literal counts, strtod reading less of it means it was too long for the copy
+    auto fallback = [&]() { return parse_float_fallback(first, position, value) == position ? position : first; };
+    bool exactInDouble = !truncated && mantissa <= (uint64_t(1) << 53) && exponent >= -22 && exponent <= 22;
+    if constexpr (std::is_same_v<T, double> || (FAST_NUMBER_FLOAT_IN_DOUBLE && std::numeric_limits<double>::digits == 53)) {
+        // Both operands are exact, so the single multiplication or division is correctly rounded
+        if (!exactInDouble) return fallback();
+        double result = static_cast<double>(mantissa);
+        result = exponent >= 0 ? result * exact_double_powers_of_ten[exponent] : result / exact_double_powers_of_ten[-exponent];
+        if constexpr (std::is_same_v<T, float>) {
+            // Rounding the double again is only wrong when it landed on the middle of two floats. These results stay
+            // within the normal float range, where the float ulp is bit 29 of the double.
+            uint64_t bits;
+            memcpy(&bits, &result, sizeof(bits));
+            if ((bits & ((uint64_t(1) << 29) - 1)) == (uint64_t(1) << 28)) return fallback();
+        }
+        value = static_cast<T>(negative ? -result : result);
+    } else {
+        // Same reasoning with float operands, a mantissa of 24 bits and the powers of ten float holds exactly
+        if (!exactInDouble || mantissa > (uint64_t(1) << 24) || exponent < -10 || exponent > 10) return fallback();
+        float result = static_cast<float>(mantissa);
+        result = exponent >= 0 ? result * exact_float_powers_of_ten[exponent] : result / exact_float_powers_of_ten[-exponent];
+        value = negative ? -result : result;
+    }
+    return position;
+}
+#endif //PAMITEENSY_FASTNUMBER_H
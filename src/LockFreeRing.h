@@ -0,0 +1,179 @@
+//
+// Created by fogoz on 14/10/2026.
+//
+
+#ifndef PAMITEENSY_LOCKFREERING_H
+#define PAMITEENSY_LOCKFREERING_H
+#include "Arduino.h"
+#include "array"
+#include "atomic"
+#include "cstring"
+#include "string"
+#include "string_view"
+
+// Same default as CommandParser.h, the line queue doesn't need the parser
+#ifndef MAX_COMMAND_LINE_SIZE
+#define MAX_COMMAND_LINE_SIZE 128
+#endif
+
+/*
+ * Byte ring with one producer and one consumer, none of them ever waits: push from a UART/DMA interrupt or from the
+ * other core, read from loop(). Positions run freely and are masked by N - 1, so N has to be a power of two.
+ * Each side only writes its own position, published with release and read with acquire, there is no lock and no
+ * interrupt masking. Bytes pushed while the ring is full are dropped and counted.
+ */
+template<size_t N>
+class SpscByteRing {
+    static_assert(N >= 2 && (N & (N - 1)) == 0, "SpscByteRing size has to be a power of two");
+
+    std::array<uint8_t, N> buffer{};
+    std::atomic<size_t> head{0};
+    std::atomic<size_t> tail{0};
+    std::atomic<uint32_t> lost{0};
+
+public:
+    // Producer side
+    bool push(uint8_t byte) {
+        size_t position = head.load(std::memory_order_relaxed);
+        if (position - tail.load(std::memory_order_acquire) == N) {
+            lost.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        buffer[position & (N - 1)] = byte;
+        head.store(position + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Producer side, publishes the whole chunk at once. Returns how many bytes fitted, the rest is dropped.
+    size_t push(const uint8_t *data, size_t size) {
+        size_t position = head.load(std::memory_order_relaxed);
+        size_t room = N - (position - tail.load(std::memory_order_acquire));
+        size_t count = size < room ? size : room;
+        for (size_t i = 0; i < count; ++i) buffer[(position + i) & (N - 1)] = data[i];
+        head.store(position + count, std::memory_order_release);
+        if (count < size) lost.fetch_add(static_cast<uint32_t>(size - count), std::memory_order_relaxed);
+        return count;
+    }
+
+    // Consumer side, -1 when empty
+    int pop() {
+        size_t position = tail.load(std::memory_order_relaxed);
+        if (position == head.load(std::memory_order_acquire)) return -1;
+        uint8_t byte = buffer[position & (N - 1)];
+        tail.store(position + 1, std::memory_order_release);
+        return byte;
+    }
+
+    int peek() const {
+        size_t position = tail.load(std::memory_order_relaxed);
+        if (position == head.load(std::memory_order_acquire)) return -1;
+        return buffer[position & (N - 1)];
+    }
+
+    size_t size() const {
+        return head.load(std::memory_order_acquire) - tail.load(std::memory_order_acquire);
+    }
+
+    // Bytes dropped because the consumer fell behind
+    uint32_t dropped() const {
+        return lost.load(std::memory_order_relaxed);
+    }
+};
+
+// A Stream reading from a SpscByteRing and writing to an ordinary output, so CommandLineHandler consumes the ring
+// directly: new CommandLineHandler(parser, ringStream) with the ISR pushing into the ring.
+template<size_t N>
+class RingInputStream : public Stream {
+    SpscByteRing<N> &ring;
+    Print &output;
+
+public:
+    using Print::write;
+
+    RingInputStream(SpscByteRing<N> &ring, Print &output) : ring(ring), output(output) {}
+
+    int available() override { return static_cast<int>(ring.size()); }
+
+    int read() override { return ring.pop(); }
+
+    int peek() override { return ring.peek(); }
+
+    size_t write(uint8_t c) override { return output.write(c); }
+
+    size_t write(const uint8_t *data, size_t size) override { return output.write(data, size); }
+
+    int availableForWrite() override { return output.availableForWrite(); }
+
+    void flush() override { output.flush(); }
+};
+
+/*
+ * Queue of complete command lines with any number of producers (interrupts, other cores, tasks) and one consumer.
+ * Bounded and without locks: a producer claims a slot with a compare and swap on the enqueue position and publishes it
+ * through the slot's sequence number, the consumer takes slots in claim order. Lines longer than LineSize are refused.
+ * Every line carries a 16 bit tag left to the caller.
+ * Feed it to CommandLineHandler::handle_lines.
+ */
+template<size_t Lines, size_t LineSize = MAX_COMMAND_LINE_SIZE>
+class MpscLineQueue {
+    static_assert(Lines >= 2 && (Lines & (Lines - 1)) == 0, "MpscLineQueue size has to be a power of two");
+
+    struct Slot {
+        // position + 1 once the line is written, position + Lines once it has been taken
+        std::atomic<size_t> sequence;
+        size_t size;
+        uint16_t tag;
+        char data[LineSize];
+    };
+
+    std::array<Slot, Lines> slots;
+    std::atomic<size_t> enqueue{0};
+    size_t dequeue = 0;
+
+public:
+    MpscLineQueue() {
+        for (size_t i = 0; i < Lines; ++i) slots[i].sequence.store(i, std::memory_order_relaxed);
+    }
+
+    // Producer side, false when the queue is full or the line too long
+    bool push(std::string_view line, uint16_t tag = 0) {
+        if (line.size() > LineSize) return false;
+        size_t position = enqueue.load(std::memory_order_relaxed);
+        Slot *slot;
+        while (true) {
+            slot = &slots[position & (Lines - 1)];
+            size_t sequence = slot->sequence.load(std::memory_order_acquire);
+            auto difference = static_cast<std::ptrdiff_t>(sequence - position);
+            if (difference == 0) {
+                if (enqueue.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) break;
+            } else if (difference < 0) {
+                return false;
+            } else {
+                position = enqueue.load(std::memory_order_relaxed);
+            }
+        }
+        memcpy(slot->data, line.data(), line.size());
+        slot->size = line.size();
+        slot->tag = tag;
+        slot->sequence.store(position + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer side, copies the oldest line into line, false when none is ready. A slot claimed but not yet written
+    // holds back the lines after it, order is kept.
+    bool pop(std::string &line) {
+        uint16_t tag;
+        return pop(line, tag);
+    }
+
+    bool pop(std::string &line, uint16_t &tag) {
+        auto &slot = slots[dequeue & (Lines - 1)];
+        if (slot.sequence.load(std::memory_order_acquire) != dequeue + 1) return false;
+        line.assign(slot.data, slot.size);
+        tag = slot.tag;
+        slot.sequence.store(dequeue + Lines, std::memory_order_release);
+        dequeue++;
+        return true;
+    }
+};
+#endif //PAMITEENSY_LOCKFREERING_H
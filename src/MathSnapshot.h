@@ -0,0 +1,341 @@
+//
+// Created by fogoz on 14/10/2026.
+//
+
+#ifndef PAMITEENSY_MATHSNAPSHOT_H
+#define PAMITEENSY_MATHSNAPSHOT_H
+#include "CommandParser.h"
+
+/*
+ * Every variable bound to a MathCommand, those of the groups included, saved or restored in one pass.
+ * Binary blob, header little-endian, values in their own type as they are in memory:
+ *   'M' 'S' | version u8 | flags u8 | count u16 | layout u32 | [changed bitmap] | values | crc u32
+ * layout is a CRC-32 of the paths and types in registration order, a blob is only restored by a registry of the same
+ * layout. A delta (flags & MATH_SNAPSHOT_DELTA) has one bit per variable, set for those whose value follows.
+ * crc is the CRC-32 of everything before it, nothing is applied from a blob that doesn't match.
+ * Text is one "path=value" line per variable, a path being the group names then the command name ("motor left pid kp=1.2").
+ * To EEPROM and back:
+ *   size_t address = 0;
+ *   snapshot.write([&address](uint8_t byte) { EEPROM.update(address++, byte); });
+ *   snapshot.restore([](size_t offset) { return EEPROM.read(offset); }, snapshot.binary_size());
+ */
+#define MATH_SNAPSHOT_VERSION 1
+#define MATH_SNAPSHOT_DELTA 1
+#define MATH_SNAPSHOT_HEADER_SIZE 10
+
+inline uint32_t crc32_update(uint32_t crc, uint8_t byte) {
+    crc ^= byte;
+    for (int i = 0; i < 8; ++i) {
+        crc = (crc & 1) ? (crc >> 1) ^ 0xEDB88320u : crc >> 1;
+    }
+    return crc;
+}
+
+class MathSnapshot {
+    struct Entry {
+        std::string path;
+        MathValue *value;
+        // Position of the value in shadow
+        size_t offset;
+    };
+
+    CommandParser &parser;
+    // Rebuilt before every operation, registering commands moves the values. Only the first used entries are current,
+    // the others keep their path capacity for the next time.
+    std::vector<Entry> entries;
+    size_t used = 0;
+    size_t valuesSize = 0;
+    uint32_t layout = 0;
+    std::string pathBuffer;
+    // Values at the last snapshot, what the changed ones are found against
+    std::vector<uint8_t> shadow;
+    std::vector<uint8_t> current;
+    uint32_t shadowLayout = 0;
+    bool shadowValid = false;
+
+    void collect(CommandParser &level, size_t prefix) {
+        for (auto &command : level.math_command_definitions()) {
+            if (used == entries.size()) entries.emplace_back();
+            auto &entry = entries[used++];
+            entry.path.assign(pathBuffer, 0, prefix).append(command.name);
+            entry.value = &command.value;
+            entry.offset = valuesSize;
+            valuesSize += command.value.size();
+            for (char c : entry.path) layout = crc32_update(layout, static_cast<uint8_t>(c));
+            layout = crc32_update(layout, 0);
+            layout = crc32_update(layout, static_cast<uint8_t>(command.value.type));
+        }
+        level.for_each_group([this, prefix](std::string_view name, std::string_view, CommandParser &group) {
+            pathBuffer.resize(prefix);
+            pathBuffer.append(name.data(), name.size()).append(" ");
+            collect(group, pathBuffer.size());
+        });
+    }
+
+    void refresh() {
+        used = 0;
+        valuesSize = 0;
+        layout = 0xFFFFFFFF;
+        pathBuffer.clear();
+        collect(parser, 0);
+        layout ^= 0xFFFFFFFF;
+        current.resize(valuesSize);
+        for (size_t i = 0; i < used; ++i) entries[i].value->save(current.data() + entries[i].offset);
+    }
+
+    // The shadow is only comparable while the layout it was taken with is still the registry's
+    bool shadowUsable() const {
+        return shadowValid && shadowLayout == layout;
+    }
+
+    bool changed(size_t index) const {
+        auto &entry = entries[index];
+        return memcmp(current.data() + entry.offset, shadow.data() + entry.offset, entry.value->size()) != 0;
+    }
+
+    void resetShadow() {
+        shadow.assign(valuesSize, 0);
+        shadowLayout = layout;
+        shadowValid = true;
+    }
+
+    void remember(size_t index) {
+        auto &entry = entries[index];
+        memcpy(shadow.data() + entry.offset, current.data() + entry.offset, entry.value->size());
+    }
+
+    template<typename Sink>
+    struct BlobWriter {
+        Sink &put;
+        uint32_t crc = 0xFFFFFFFF;
+        size_t size = 0;
+
+        void byte(uint8_t value) {
+            crc = crc32_update(crc, value);
+            put(value);
+            size++;
+        }
+
+        void integer(uint32_t value, size_t bytes) {
+            for (size_t i = 0; i < bytes; ++i) byte(static_cast<uint8_t>(value >> (8 * i)));
+        }
+    };
+
+    template<typename Sink>
+    size_t writeBlob(Sink &put, bool onlyChanged) {
+        refresh();
+        bool delta = onlyChanged && shadowUsable();
+        BlobWriter<Sink> out{put};
+        out.byte('M');
+        out.byte('S');
+        out.byte(MATH_SNAPSHOT_VERSION);
+        out.byte(delta ? MATH_SNAPSHOT_DELTA : 0);
+        out.integer(static_cast<uint32_t>(used), 2);
+        out.integer(layout, 4);
+        if (delta) {
+            for (size_t i = 0; i < used; i += 8) {
+                uint8_t bits = 0;
+                for (size_t j = i; j < used && j < i + 8; ++j) bits |= changed(j) << (j - i);
+                out.byte(bits);
+            }
+        }
+        for (size_t i = 0; i < used; ++i) {
+            if (delta && !changed(i)) continue;
+            auto &entry = entries[i];
+            for (size_t j = 0; j < entry.value->size(); ++j) out.byte(current[entry.offset + j]);
+        }
+        uint32_t crc = out.crc ^ 0xFFFFFFFF;
+        out.integer(crc, 4);
+        shadow = current;
+        shadowLayout = layout;
+        shadowValid = true;
+        return out.size;
+    }
+
+    int format(size_t index, char *out, size_t size) const {
+        auto &entry = entries[index];
+        return entry.value->format(out, size, current.data() + entry.offset);
+    }
+
+    // The whole text has to be the number, as written by format
+    template<typename T>
+    static bool parseAs(std::string_view text, MathValue &value) {
+        const char *first = text.data();
+        const char *last = first + text.size();
+        T parsed;
+        if constexpr (std::is_same_v<T, bool>) {
+            uint8_t bit;
+            if (first == last || parse_integer<uint8_t>(first, last, bit, 0, 1) != last) return false;
+            parsed = bit != 0;
+        } else if constexpr (std::is_floating_point_v<T>) {
+            if (first == last || parse_float(first, last, parsed) != last) return false;
+        } else {
+            if (first == last || parse_integer(first, last, parsed) != last) return false;
+        }
+        uint8_t raw[sizeof(T)];
+        memcpy(raw, &parsed, sizeof(T));
+        value.restore(raw);
+        return true;
+    }
+
+    static bool parse(std::string_view text, MathValue &value) {
+        switch (value.type) {
+#define MATH_VALUE_TYPE(name, T) case MathValueType::name: return parseAs<T>(text, value);
+            MATH_VALUE_TYPES
+#undef MATH_VALUE_TYPE
+        }
+        return false;
+    }
+
+    static std::string_view trim(std::string_view text) {
+        auto first = text.find_first_not_of(" \t\r\n");
+        if (first == std::string_view::npos) return {};
+        auto last = text.find_last_not_of(" \t\r\n");
+        return text.substr(first, last - first + 1);
+    }
+
+    static bool samePath(std::string_view a, std::string_view b) {
+        if (a.size() != b.size()) return false;
+        for (size_t i = 0; i < a.size(); ++i) {
+            if (tolower(a[i]) != b[i]) return false;
+        }
+        return true;
+    }
+
+    // Lines from index on, stops at the first one the writer refuses. Returns true once the last one is written.
+    // Every written value becomes the reference, without one to compare with onlyChanged is turned off.
+    bool writeText(ResponseWriter &out, size_t &index, bool &onlyChanged) {
+        refresh();
+        if (index == 0 && (!onlyChanged || !shadowUsable())) {
+            onlyChanged = false;
+            resetShadow();
+        }
+        char value[32];
+        for (; index < used; ++index) {
+            if (onlyChanged && !changed(index)) continue;
+            format(index, value, sizeof(value));
+            if (!out.printf("%s=%s\r\n", entries[index].path.c_str(), value)) return false;
+            remember(index);
+        }
+        return true;
+    }
+
+public:
+    explicit MathSnapshot(CommandParser &parser) : parser(parser) {}
+
+    // Size of a full binary snapshot of the current registry
+    size_t binary_size() {
+        refresh();
+        return MATH_SNAPSHOT_HEADER_SIZE + valuesSize + 4;
+    }
+
+    // Whole snapshot, byte by byte through put(uint8_t), returns its size. It becomes the reference of write_changed.
+    template<typename Sink>
+    size_t write(Sink &&put) {
+        return writeBlob(put, false);
+    }
+
+    // Only the variables changed since the last snapshot (binary or text), a full one when there was none
+    template<typename Sink>
+    size_t write_changed(Sink &&put) {
+        return writeBlob(put, true);
+    }
+
+    size_t write(std::string &blob) {
+        blob.clear();
+        return write([&blob](uint8_t byte) { blob.push_back(static_cast<char>(byte)); });
+    }
+
+    size_t write_changed(std::string &blob) {
+        blob.clear();
+        return write_changed([&blob](uint8_t byte) { blob.push_back(static_cast<char>(byte)); });
+    }
+
+    // Applies a full or delta blob read through get(size_t offset), nothing at all when it is damaged or was written
+    // by a registry of another layout. The restored values become the reference of write_changed.
+    template<typename Source>
+    bool restore(Source &&get, size_t size) {
+        refresh();
+        if (size < MATH_SNAPSHOT_HEADER_SIZE + 4) return false;
+        uint32_t crc = 0xFFFFFFFF;
+        for (size_t i = 0; i < size - 4; ++i) crc = crc32_update(crc, get(i));
+        uint32_t stored = 0;
+        for (size_t i = 0; i < 4; ++i) stored |= static_cast<uint32_t>(get(size - 4 + i)) << (8 * i);
+        if ((crc ^ 0xFFFFFFFF) != stored) return false;
+
+        if (get(0) != 'M' || get(1) != 'S' || get(2) != MATH_SNAPSHOT_VERSION) return false;
+        bool delta = get(3) & MATH_SNAPSHOT_DELTA;
+        size_t count = get(4) | (get(5) << 8);
+        uint32_t blobLayout = 0;
+        for (size_t i = 0; i < 4; ++i) blobLayout |= static_cast<uint32_t>(get(6 + i)) << (8 * i);
+        if (count != used || blobLayout != layout) return false;
+
+        size_t bitmap = MATH_SNAPSHOT_HEADER_SIZE;
+        size_t position = bitmap + (delta ? (count + 7) / 8 : 0);
+        auto included = [&](size_t index) { return !delta || (get(bitmap + index / 8) >> (index % 8)) & 1; };
+        size_t expected = position + 4;
+        for (size_t i = 0; i < used; ++i) {
+            if (included(i)) expected += entries[i].value->size();
+        }
+        if (expected != size) return false;
+
+        bool reference = shadowUsable();
+        uint8_t raw[8];
+        for (size_t i = 0; i < used; ++i) {
+            if (!included(i)) continue;
+            auto &entry = entries[i];
+            for (size_t j = 0; j < entry.value->size(); ++j) raw[j] = get(position++);
+            entry.value->restore(raw);
+            entry.value->save(current.data() + entry.offset);
+            if (reference) remember(i);
+        }
+        return true;
+    }
+
+    bool restore(std::string_view blob) {
+        return restore([blob](size_t offset) { return static_cast<uint8_t>(blob[offset]); }, blob.size());
+    }
+
+    // One "path=value" line per variable, or per changed variable with onlyChanged, written to stream at once
+    void write_text(Stream &stream, bool onlyChanged = false) {
+        size_t index = 0;
+        ResponseWriter out(stream, static_cast<size_t>(-1));
+        writeText(out, index, onlyChanged);
+    }
+
+    // Lines of "path=value" separated by new lines or ';'. Returns how many were applied, lines with an unknown path
+    // or a value that doesn't parse in the variable's type are skipped.
+    size_t restore_text(std::string_view text) {
+        refresh();
+        size_t applied = 0;
+        while (!text.empty()) {
+            auto end = text.find_first_of(";\r\n");
+            std::string_view line = text.substr(0, end);
+            text.remove_prefix(end == std::string_view::npos ? text.size() : end + 1);
+            auto equal = line.find('=');
+            if (equal == std::string_view::npos) continue;
+            std::string_view path = trim(line.substr(0, equal));
+            std::string_view value = trim(line.substr(equal + 1));
+            for (size_t i = 0; i < used; ++i) {
+                if (!samePath(path, entries[i].path)) continue;
+                if (parse(value, *entries[i].value)) applied++;
+                break;
+            }
+        }
+        return applied;
+    }
+
+    // Registers name, a streaming command writing the text form a chunk per turn: "name" for every variable,
+    // "name changed" for the changed ones only
+    bool register_command(const std::string &name = "params") {
+        return parser.registerCommand(name, "os", CommandParser::CommandStreamCallback(
+            [this](CommandParser::ArgumentSpan args, Stream &) {
+                bool onlyChanged = args[0] && args[0].asString() == "changed";
+                size_t index = 0;
+                return CommandParser::CommandGenerator([this, onlyChanged, index](ResponseWriter &out) mutable {
+                    return writeText(out, index, onlyChanged);
+                });
+            }), PSTR("Every math variable as path=value, 'changed' for those changed since the last snapshot"));
+    }
+};
+#endif //PAMITEENSY_MATHSNAPSHOT_H
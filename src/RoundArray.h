@@ -7,6 +7,8 @@
 #include "Arduino.h"
 #include "vector"
 #include "string"
+#include "string_view"
+#include "algorithm"
 
 class RoundArray {
     std::vector<std::string> strs;
@@ -14,18 +16,25 @@ class RoundArray {
     int lookingIndex = 0;
     int max_size;
     bool block_if_empty;
+    size_t entry_size;
 public:
-    RoundArray(int max_size = 10, bool block_if_empty=true) : strs(max_size, ""), max_size(max_size), block_if_empty(block_if_empty) {
-
+    // Every entry is reserved to entry_size, storing a line that fits never allocates
+    RoundArray(int max_size = 10, bool block_if_empty=true, size_t entry_size = 0) : strs(max_size, ""), max_size(max_size), block_if_empty(block_if_empty), entry_size(entry_size) {
+        for (auto &str : strs) {
+            str.reserve(entry_size);
+        }
     }
 
-    void add(const std::string &str) {
-        std::string cmd = str;
-        cmd.erase(cmd.find_last_not_of(" \n\r\t") + 1);
+    void add(std::string_view cmd) {
+        auto end = cmd.find_last_not_of(" \n\r\t");
+        cmd = cmd.substr(0, end == std::string_view::npos ? 0 : end + 1);
+#ifdef COMMAND_PARSER_FIXED_MEMORY
+        if (entry_size != 0) cmd = cmd.substr(0, entry_size);
+#endif
         if (strs[(index + max_size - 1) % max_size] == cmd) {
             return;
         }
-        strs[index] = cmd;
+        strs[index].assign(cmd.data(), cmd.size());
         index = (index + 1) % max_size;
         lookingIndex = index;
     }
@@ -51,4 +60,144 @@ public:
     }
 
 };
+
+// History kept in a single byte ring, each entry is its length (u16), its text, then its length again so the ring can
+// be walked both ways. The oldest entries are evicted until the new one fits, however many that takes.
+class HistoryRing {
+    std::vector<uint8_t> ring;
+    size_t start = 0;
+    size_t used = 0;
+    size_t looking = 0;
+    bool browsing = false;
+
+    size_t wrap(size_t position) const {
+        return position % ring.size();
+    }
+
+    uint8_t at(size_t position) const {
+        return ring[wrap(position)];
+    }
+
+    size_t lengthAt(size_t position) const {
+        return at(position) | (at(position + 1) << 8);
+    }
+
+    void put(size_t position, uint8_t byte) {
+        ring[wrap(position)] = byte;
+    }
+
+    size_t head() const {
+        return wrap(start + used);
+    }
+
+    size_t newest() const {
+        size_t end = head() + ring.size();
+        return wrap(end - 4 - lengthAt(end - 2));
+    }
+
+    bool older(size_t &position) const {
+        if (position == start) return false;
+        size_t end = position + ring.size();
+        position = wrap(end - 4 - lengthAt(end - 2));
+        return true;
+    }
+
+    bool newer(size_t &position) const {
+        size_t next = wrap(position + 4 + lengthAt(position));
+        if (next == head()) return false;
+        position = next;
+        return true;
+    }
+
+    void copy(size_t position, std::string &out) const {
+        size_t length = lengthAt(position);
+        out.clear();
+        for (size_t i = 0; i < length; ++i) out += static_cast<char>(at(position + 2 + i));
+    }
+
+    bool contains(size_t position, std::string_view needle) const {
+        size_t length = lengthAt(position);
+        if (needle.size() > length) return false;
+        for (size_t offset = 0; offset + needle.size() <= length; ++offset) {
+            size_t i = 0;
+            while (i < needle.size() && at(position + 2 + offset + i) == static_cast<uint8_t>(needle[i])) ++i;
+            if (i == needle.size()) return true;
+        }
+        return false;
+    }
+
+    bool equals(size_t position, std::string_view text) const {
+        if (lengthAt(position) != text.size()) return false;
+        for (size_t i = 0; i < text.size(); ++i) {
+            if (at(position + 2 + i) != static_cast<uint8_t>(text[i])) return false;
+        }
+        return true;
+    }
+
+public:
+    // The only allocation, the ring never grows afterwards
+    explicit HistoryRing(size_t bytes) : ring(std::max<size_t>(bytes, 4)) {}
+
+    [[nodiscard]] bool empty() const { return used == 0; }
+
+    // Trailing whitespace is dropped, empty lines, lines repeating the newest entry and lines larger than the ring are not kept
+    void add(std::string_view cmd) {
+        auto end = cmd.find_last_not_of(" \n\r\t");
+        cmd = cmd.substr(0, end == std::string_view::npos ? 0 : end + 1);
+        browsing = false;
+        size_t size = cmd.size() + 4;
+        if (cmd.empty() || size > ring.size() || cmd.size() > 0xFFFF) return;
+        if (used != 0 && equals(newest(), cmd)) return;
+        while (ring.size() - used < size) {
+            size_t evicted = lengthAt(start) + 4;
+            start = wrap(start + evicted);
+            used -= evicted;
+        }
+        size_t position = head();
+        put(position, cmd.size() & 0xFF);
+        put(position + 1, cmd.size() >> 8);
+        for (size_t i = 0; i < cmd.size(); ++i) put(position + 2 + i, cmd[i]);
+        put(position + 2 + cmd.size(), cmd.size() & 0xFF);
+        put(position + 3 + cmd.size(), cmd.size() >> 8);
+        used += size;
+    }
+
+    // Both copy the entry into out and return false, leaving out untouched, when there is nothing further that way
+    bool go_up(std::string &out) {
+        if (used == 0) return false;
+        if (!browsing) {
+            looking = newest();
+            browsing = true;
+        } else if (!older(looking)) {
+            return false;
+        }
+        copy(looking, out);
+        return true;
+    }
+
+    bool go_down(std::string &out) {
+        if (!browsing || !newer(looking)) return false;
+        copy(looking, out);
+        return true;
+    }
+
+    void goto_last() {
+        browsing = false;
+    }
+
+    // Reverse incremental search: looks for an entry containing needle, from the one being browsed (or the newest)
+    // towards the oldest. skipCurrent starts one entry older, for a repeated Ctrl-R. A match becomes the browsed entry.
+    bool search(std::string_view needle, bool skipCurrent, std::string &out) {
+        if (used == 0) return false;
+        size_t position = browsing ? looking : newest();
+        if (browsing && skipCurrent && !older(position)) return false;
+        while (!contains(position, needle)) {
+            if (!older(position)) return false;
+        }
+        looking = position;
+        browsing = true;
+        copy(position, out);
+        return true;
+    }
+};
 #endif //PAMITEENSY_ROUNDARRAY_H
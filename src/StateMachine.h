@@ -5,57 +5,193 @@
 #ifndef PAMITEENSY_STATEMACHINE_H
 #define PAMITEENSY_STATEMACHINE_H
 #include "Arduino.h"
-#include "vector"
+#include "array"
+#include "cstdint"
 
-#define UP_LAST_CHAR 'A'
-#define DOWN_LAST_CHAR 'B'
-#define RIGHT_LAST_CHAR 'C'
-#define LEFT_LAST_CHAR 'D'
+// Longest sequence kept after the ESC, "[1;5C" needs 4 bytes before its final one
+#define MAX_ESCAPE_SEQUENCE 8
 
+// What a byte fed to the state machine completed
+enum class EscapeKey : uint8_t {
+    PENDING,  // the sequence goes on, wait for the next byte
+    REJECTED, // the byte is not part of a sequence, rejected() holds what was swallowed before it
+    UNKNOWN,  // a complete sequence without a meaning here, dropped
+    UP,
+    DOWN,
+    RIGHT,
+    LEFT,
+    HOME,
+    END,
+    INSERT,
+    DELETE,
+    PAGE_UP,
+    PAGE_DOWN,
+    F1,
+    F2,
+    F3,
+    F4
+};
+
+// Bytes of an escape sequence that was not recognised, handed back so they can be echoed. Points into the state machine.
+struct EscapeBytes {
+    const uint8_t *data = nullptr;
+    size_t size = 0;
+
+    bool empty() const { return size == 0; }
+
+    const uint8_t *begin() const { return data; }
 
+    const uint8_t *end() const { return data + size; }
+};
+
+// Byte classes of the escape DFA
+enum EscapeClass : uint8_t {
+    ESCAPE_DIGIT,
+    ESCAPE_SEPARATOR,
+    ESCAPE_BRACKET,
+    ESCAPE_SS3_INTRODUCER,
+    ESCAPE_FINAL,
+    ESCAPE_TILDE,
+    ESCAPE_OTHER,
+    ESCAPE_CLASS_COUNT
+};
+
+struct EscapeClassTable {
+    EscapeClass value[256];
+};
+
+constexpr EscapeClassTable makeEscapeClassTable() {
+    EscapeClassTable table{};
+    for (auto &c : table.value) c = ESCAPE_OTHER;
+    for (int c = '0'; c <= '9'; ++c) table.value[c] = ESCAPE_DIGIT;
+    for (int c = 'A'; c <= 'Z'; ++c) table.value[c] = ESCAPE_FINAL;
+    table.value[';'] = ESCAPE_SEPARATOR;
+    table.value['['] = ESCAPE_BRACKET;
+    table.value['O'] = ESCAPE_SS3_INTRODUCER;
+    table.value['~'] = ESCAPE_TILDE;
+    return table;
+}
+
+inline constexpr EscapeClassTable escape_classes = makeEscapeClassTable();
+
+/*
+ * DFA over what follows an ESC: CSI (ESC [ params final, ESC [ n ~) and SS3 (ESC O final).
+ * Every byte is classified through a table, then the action comes from a [state][class] table, no allocation and no
+ * callback: the caller gets an EscapeKey and switches on it.
+ */
 class StateMachine {
-    bool started = false;
-    std::vector<uint8_t> chars;
-    std::vector<std::function<void()>> functions;
+    enum State : uint8_t {
+        ESCAPE,
+        CSI,
+        SS3,
+        STATE_COUNT
+    };
 
-public:
-    StateMachine() : functions(26, nullptr) {
+    enum Action : uint8_t {
+        TO_CSI,
+        TO_SS3,
+        ADD_DIGIT,
+        NEXT_PARAMETER,
+        DISPATCH_FINAL,
+        DISPATCH_TILDE,
+        DROP,
+        REJECT
+    };
 
-    }
+    // In CSI, 'O' is an ordinary final letter
+    static constexpr Action actions[STATE_COUNT][ESCAPE_CLASS_COUNT] = {
+        /* ESCAPE */ {DROP, DROP, TO_CSI, TO_SS3, DROP, DROP, DROP},
+        /* CSI    */ {ADD_DIGIT, NEXT_PARAMETER, REJECT, DISPATCH_FINAL, DISPATCH_FINAL, DISPATCH_TILDE, REJECT},
+        /* SS3    */ {ADD_DIGIT, REJECT, REJECT, REJECT, DISPATCH_FINAL, REJECT, REJECT},
+    };
+
+    // Final letters shared by CSI and SS3, from 'A'
+    static constexpr EscapeKey finals[26] = {
+        EscapeKey::UP, EscapeKey::DOWN, EscapeKey::RIGHT, EscapeKey::LEFT, EscapeKey::UNKNOWN, EscapeKey::END,
+        EscapeKey::UNKNOWN, EscapeKey::HOME, EscapeKey::UNKNOWN, EscapeKey::UNKNOWN, EscapeKey::UNKNOWN,
+        EscapeKey::UNKNOWN, EscapeKey::UNKNOWN, EscapeKey::UNKNOWN, EscapeKey::UNKNOWN, EscapeKey::F1, EscapeKey::F2,
+        EscapeKey::F3, EscapeKey::F4, EscapeKey::UNKNOWN, EscapeKey::UNKNOWN, EscapeKey::UNKNOWN, EscapeKey::UNKNOWN,
+        EscapeKey::UNKNOWN, EscapeKey::UNKNOWN, EscapeKey::UNKNOWN
+    };
+
+    // ESC [ n ~, 7 and 8 are what rxvt sends for Home and End
+    static constexpr EscapeKey tildes[9] = {
+        EscapeKey::UNKNOWN, EscapeKey::HOME, EscapeKey::INSERT, EscapeKey::DELETE, EscapeKey::END,
+        EscapeKey::PAGE_UP, EscapeKey::PAGE_DOWN, EscapeKey::HOME, EscapeKey::END
+    };
 
-    void set(char c, std::function<void()> fct){
-        functions[c-'A'] = fct;
+    bool started = false;
+    State state = ESCAPE;
+    std::array<uint8_t, MAX_ESCAPE_SEQUENCE> chars{};
+    size_t count = 0;
+    std::array<uint16_t, 2> params{};
+    size_t paramIndex = 0;
+    uint8_t lastModifier = 1;
+
+    EscapeKey finish(EscapeKey key) {
+        started = false;
+        return key;
     }
 
+public:
     void begin() {
-        chars.clear();
         started = true;
+        state = ESCAPE;
+        count = 0;
+        params = {0, 0};
+        paramIndex = 0;
+        lastModifier = 1;
     }
 
-    bool isStarted() {
+    bool isStarted() const {
         return started;
     }
 
-    std::vector<uint8_t> append(char c) {
-        if (chars.empty() && c == 91) {
-            chars.push_back(c);
-            return {};
-        }
-        if (chars.size() == 1 && chars[0] == '[') {
-            if(c>=65 && c <= 90){
-                auto a = functions[c-'A'];
-                if(a){
-                    a();
-                }
-                chars.clear();
-                started = false;
-            }
+    // Feeds the byte following the ESC, or a later one while PENDING is returned
+    EscapeKey append(char c) {
+        uint8_t byte = static_cast<uint8_t>(c);
+        Action action = actions[state][escape_classes.value[byte]];
+        // The sequence is stored for REJECTED, one that doesn't fit is rejected too
+        bool stores = action == TO_CSI || action == TO_SS3 || action == ADD_DIGIT || action == NEXT_PARAMETER;
+        if (stores && count == chars.size()) action = REJECT;
+        switch (action) {
+            case TO_CSI:
+                state = CSI;
+                break;
+            case TO_SS3:
+                state = SS3;
+                break;
+            case ADD_DIGIT:
+                if (params[paramIndex] < 1000) params[paramIndex] = params[paramIndex] * 10 + (byte - '0');
+                break;
+            case NEXT_PARAMETER:
+                if (paramIndex + 1 < params.size()) paramIndex++;
+                break;
+            case DISPATCH_FINAL:
+                // xterm puts the modifier second in CSI (ESC [ 1 ; 5 C), some terminals first in SS3 (ESC O 5 C)
+                lastModifier = static_cast<uint8_t>(state == CSI ? params[1] : params[0]);
+                if (lastModifier == 0) lastModifier = 1;
+                return finish(finals[byte - 'A']);
+            case DISPATCH_TILDE:
+                lastModifier = params[1] == 0 ? 1 : static_cast<uint8_t>(params[1]);
+                return finish(params[0] < 9 ? tildes[params[0]] : EscapeKey::UNKNOWN);
+            case DROP:
+                return finish(EscapeKey::UNKNOWN);
+            case REJECT:
+                return finish(EscapeKey::REJECTED);
         }
-        std::vector<uint8_t> result = chars;
-        chars.clear();
-        started = false;
-        return result;
+        chars[count++] = byte;
+        return EscapeKey::PENDING;
+    }
+
+    // Bytes swallowed before the byte that made append return REJECTED
+    EscapeBytes rejected() const {
+        return EscapeBytes{chars.data(), count};
+    }
 
+    // xterm modifier of the last key: 1 none, 2 shift, 3 alt, 5 ctrl
+    uint8_t modifier() const {
+        return lastModifier;
     }
 };
 #endif //PAMITEENSY_STATEMACHINE_H